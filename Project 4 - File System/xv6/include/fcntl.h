@@ -8,4 +8,10 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 
+// Where lseek measures the offset from
+
+#define SEEK_SET  0  // start of file
+#define SEEK_CUR  1  // current offset
+#define SEEK_END  2  // end of file
+
 #endif //_FCNTL_H_
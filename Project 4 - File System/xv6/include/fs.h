@@ -6,43 +6,102 @@
 
 // Block 0 is unused.
 // Block 1 is super block.
-// Inodes start at block 2.
+// Blocks logstart through logstart+nlog-1 are the log: a header
+// block, then the blocks of the transactions it records.
+// The rest of the disk is split into ngroups allocation groups
+// of bpg blocks each, the last possibly shorter.  A group starts
+// with ipg/IPB blocks of inodes, then one block of bitmap for the
+// group's blocks, then data blocks.  Inode i is in group i/ipg.
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+
+// Block size: a multiple of the 512-byte disk sector, at most
+// a page.  Set it with make BSIZE=...; the kernel, mkfs and user
+// programs must agree, and the kernel will not mount a file
+// system whose superblock says otherwise.
+#ifndef BSIZE
+#define BSIZE 4096
+#endif
 
 // File system super block
 struct superblock {
   uint size;         // Size of file system image (blocks)
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
+  uint nfreeblocks;  // Number of free blocks
+  uint nfreeinodes;  // Number of free inodes
+  uint ngroups;      // Number of allocation groups
+  uint bpg;          // Blocks per group
+  uint ipg;          // Inodes per group
+  uint logstart;     // Block number of first log block
+  uint nlog;         // Number of log blocks
+  uint bsize;        // Block size (bytes)
 };
 
-#define NDIRECT 12
+#define NDIRECT 9
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define NMAPPED (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+// Max file blocks: those mapped, but no more than a uint of bytes.
+#define MAXFILE (NMAPPED < 0xFFFFFFFF/BSIZE ? NMAPPED : 0xFFFFFFFF/BSIZE)
+#define NINLINE 112  // bytes of data a DI_INLINE inode holds itself
 
 // On-disk inode structure
 struct dinode {
   short type;           // File type
-  short major;          // Major device number (T_DEV only)
+  short major;          // Major device number (T_DEV only),
+                        // or hash buckets (T_DIR only; see below)
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // DI_ flags
+  union {
+    uint addrs[NDIRECT+3];   // Data block addresses
+    char data[NINLINE];      // DI_INLINE: the file's contents
+  };
+};
+
+// Inode flags.
+#define DI_EXTENTS 0x1  // addrs holds extents, not block addresses
+#define DI_INLINE  0x2  // data holds the whole file, with no blocks
+
+// With DI_INLINE, a file or directory of up to NINLINE bytes is
+// kept in the inode, so reading it needs no block after the
+// inode's.  Bytes past size are zero.  A file that grows past
+// NINLINE moves its data to a block and maps blocks as usual.
+
+// With DI_EXTENTS, addrs holds up to NEXTENT runs of blocks, in
+// file order; unused ones have len 0.  A file that needs more
+// runs is switched back to addresses.
+struct extent {
+  uint start;  // first block of run
+  uint len;    // blocks in run
 };
 
+#define NEXTENT ((NDIRECT+3) / 2)
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
+// First block of group g
+#define GSTART(g, sb)  ((sb).logstart + (sb).nlog + (g)*(sb).bpg)
+
+// Group holding block b
+#define BGROUP(b, sb)  (((b) - GSTART(0, sb)) / (sb).bpg)
+
 // Block containing inode i
-#define IBLOCK(i)     ((i) / IPB + 2)
+#define IBLOCK(i, sb)  (GSTART((i)/(sb).ipg, sb) + (i)%(sb).ipg/IPB)
 
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
-// Block containing bit for block b
-#define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
+// Block containing bit for block b, and the bit
+#define BBLOCK(b, sb)  (GSTART(BGROUP(b, sb), sb) + (sb).ipg/IPB)
+#define BBIT(b, sb)    (((b) - GSTART(0, sb)) % (sb).bpg)
+
+// Bytes of a file's tag block that hold tags, 32 per tag.
+#define TAGSIZE 512
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -52,4 +111,20 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory with major == 0 is linear: a name may be in any
+// entry.  One with major == nb > 0 is hashed: its first nb blocks
+// are buckets, and a name other than "." or ".." is only ever in
+// block DIRBUCKET(dirhash(name), nb).  "." and ".." are the first
+// two entries of block 0, as in a linear directory.  Buckets are
+// added one at a time by linear hashing: adding bucket nb splits
+// bucket nb - 2^k, where 2^k is the largest power of 2 <= nb.
+// The bucket count lives in the short major, so a hashed
+// directory has at most NDIRBUCKET buckets.
+// Either way the directory is an array of dirents with holes,
+// so programs that just read it see every entry.
+#define NDIRBUCKET 32767
+
 #endif // _FS_H_
@@ -8,12 +8,27 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
-#define NINODE       50  // maximum number of active i-nodes
+#define NBUF       1024  // maximum size of disk block cache
+#define NINODE      500  // maximum number of cached i-nodes
+#define NDENTRY     256  // directory name lookup cache entries
+#define NPAGE        64  // maximum pages in the page cache, for mmap
+#define EXTENTS       1  // new files and directories map blocks by extents
+#define INLINE        1  // new files and directories start inline in the inode
+#define NBMAP         8  // indirect block entries cached per inode
+#define NGROUP       16  // maximum allocation groups in a file system
+#define NDALLOC      32  // files with delayed block allocation; 0 disables it
+#define NDWIN         8  // blocks in a file's delayed allocation window
+#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define LOGSIZE      40  // max data blocks in on-disk log
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define USERTOP  0xA0000 // end of user address space
 #define PHYSTOP  0x1000000 // use phys mem up to here as free pool
 #define MAXARG       32  // max exec arguments
+#define WRITEBACK     1  // bwrite only marks buffers dirty; fsflushd writes them
+#define FLUSHTICKS  100  // ticks between fsflushd write-backs
+#define NFLUSH       32  // dirty buffers written back per batch
+#define NREADAHEAD   32  // maximum blocks a file reads ahead
+#define BCACHE2Q      1  // buffer cache replacement: 1 for 2Q, 0 for LRU
 
 #endif // _PARAM_H_
@@ -15,4 +15,13 @@ struct stat {
   uint size;   // Size of file in bytes
 };
 
+// File system statistics, for use with statfs syscall
+struct statfs {
+  uint bsize;   // Block size in bytes
+  uint blocks;  // Blocks in file system
+  uint bfree;   // Free blocks
+  uint files;   // Inodes in file system
+  uint ffree;   // Free inodes
+};
+
 #endif // _STAT_H_
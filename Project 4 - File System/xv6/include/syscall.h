@@ -28,5 +28,13 @@
 #define SYS_getFileTag 24
 #define SYS_getAllTags 25
 #define SYS_getFilesByTag 26
+#define SYS_sync   27
+#define SYS_fsync  28
+#define SYS_statfs 29
+#define SYS_ftruncate 30
+#define SYS_mmap   31
+#define SYS_lseek  32
+#define SYS_pread  33
+#define SYS_pwrite 34
 
 #endif // _SYSCALL_H_
\ No newline at end of file
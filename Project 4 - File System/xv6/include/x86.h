@@ -98,6 +98,15 @@ loadgs(ushort v)
   asm volatile("movw %0, %%gs" : : "r" (v));
 }
 
+// Index of the lowest set bit in x, which must not be 0.
+static inline uint
+bsf(uint x)
+{
+  uint val;
+  asm("bsfl %1,%0" : "=r" (val) : "rm" (x));
+  return val;
+}
+
 static inline uint
 rebp(void)
 {
@@ -1,138 +1,737 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
-// in memory reduces the number of disk reads and also provides
-// a synchronization point for disk blocks used by multiple processes.
-// 
+// The buffer cache is a set of hash buckets, each a linked list
+// of buf structures holding cached copies of disk block contents.
+// Caching disk blocks in memory reduces the number of disk reads
+// and also provides a synchronization point for disk blocks used
+// by multiple processes.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to flush it to disk.
+// * To start reading a block that will be wanted soon, call breada.
+// * To read several blocks at once, call bread_async for each
+//     and then bwait for each.
+// * To get a buffer only if its block is cached, call bpeek.
+// * To overwrite a whole block, call boverwrite instead of
+//     bread: it does not read the block from disk first.
+// * After changing buffer data, call bwrite to write it to disk.
+//     With WRITEBACK set, bwrite only marks the buffer dirty and
+//     the write happens later, in bflush; call bflush to force it.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
-// 
+//
 // The implementation uses three state flags internally:
 // * B_BUSY: the block has been returned from bread
-//     and has not been passed back to brelse.  
+//     and has not been passed back to brelse.
 // * B_VALID: the buffer data has been initialized
 //     with the associated disk block contents.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_LOGGED: the buffer data was changed by a transaction
+//     that the log has not committed yet, so it must not be
+//     written to disk or recycled; see log.c.
+//
+// Locking: each bucket has its own lock protecting its list and
+// the flags of the buffers on it, so processes using different
+// blocks do not contend.  Recycling a buffer moves it from one
+// bucket to another; bcache.lock serializes those moves, and
+// protects the replacement lists.  bcache.lock comes before a
+// bucket lock.  No process ever holds two bucket locks at once.
+//
+// The cache starts empty and grows a page of buffers at a time,
+// from kalloc(), up to NBUF buffers.  When kalloc() runs out of
+// memory it calls bshrink() to give back a page of idle buffers.
+// If every buffer is busy and the cache cannot grow, bget() waits
+// for a brelse().  Dirty buffers are never recycled or given back
+// until bflush() has written them, or the log, if B_LOGGED.
+//
+// Replacement: with BCACHE2Q set, bget() uses the 2Q policy.
+// A block read for the first time goes on the A1in queue, which
+// is recycled in FIFO order once it holds more than a quarter of
+// the cache, so a long sequential scan only cycles through A1in.
+// The addresses of blocks recycled from A1in are remembered on the
+// A1out ghost list; a block that is read again while on A1out has
+// been reused and goes on Am, which is recycled in LRU order.
+// With BCACHE2Q clear, every block goes on Am: plain LRU.
+// To compare the two, run the same workload under each and
+// read the hit and miss counts that ^P prints (bdump).
+// Each queue, and the empty buffers, is a list through lprev
+// and lnext, most recent first, so bvictim() takes the oldest
+// from the end of one.  A block goes on its list when bget()
+// caches it.  So that releasing a buffer takes no global lock,
+// brelse() leaves the lists alone and only sets B_REF; bvictim()
+// requeues lazily instead.  A buffer it finds at the end in use
+// or dirty, or on Am with B_REF set, goes back to the recent end
+// with B_REF clear, for another round: Am is approximately LRU,
+// by the clock algorithm, and A1in is FIFO.  The A1out ghost
+// list is a ring, hashed by block so bget() finds a ghost quickly.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
+#include "fs.h"
 #include "buf.h"
 
-struct {
+#define BPP (PGSIZE/BSIZE)  // buffers sharing one page of data
+
+#define NBUCKET 61  // hash buckets; prime to spread sequential blocks
+#define NGHOST (NBUF/2)  // size of the A1out ghost list
+
+#define BHASH(dev, blockno) (((dev)*31 + (blockno)) % NBUCKET)
+#define GHASH(dev, blockno) (((dev)*31 + (blockno)) % NGHOST)
+
+// Bucket holding b.  Buffers not holding any block have
+// dev -1 and blockno 0, so they all share one bucket.
+#define BBUCKET(b) (&bcache.bucket[BHASH((b)->dev, (b)->blockno)])
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  uint hits;  // bget()s that found their block here
 
-  // Linked list of all buffers, through prev/next.
+  // Linked list of buffers in this bucket, through prev/next.
   // head.next is most recently used.
   struct buf head;
+};
+
+struct {
+  struct spinlock lock;  // serializes moving buffers between buckets
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+
+  // Data page of buf[i*BPP] through buf[i*BPP+BPP-1], or 0
+  // if those buffers are not part of the cache right now.
+  uchar *page[NBUF/BPP];
+  int nbuf;     // buffers currently in the cache
+  int waiting;  // processes in bget() waiting for a free buffer
+
+  // 2Q state, protected by bcache.lock.
+  uint misses;  // bget()s that had to recycle a buffer
+  // Heads of the replacement lists, indexed by b->queue, and
+  // their lengths; head.lnext is most recent.  BQ_NONE holds
+  // empty buffers.
+  struct buf q[BQ_AM+1];
+  int nq[BQ_AM+1];
+  struct {
+    uint dev;
+    uint blockno;
+    int next;       // next ghost in its hash chain, or -1
+  } ghost[NGHOST];  // A1out, a ring of recycled A1in blocks
+  int ghostnext;    // ghost slot to overwrite next
+  int ghash[NGHOST];  // first ghost in each hash chain, or -1
 } bcache;
 
+// Insert b at the most recently used end of bkt.
+// Caller must hold bkt->lock.
+static void
+bpush(struct bucket *bkt, struct buf *b)
+{
+  b->next = bkt->head.next;
+  b->prev = &bkt->head;
+  bkt->head.next->prev = b;
+  bkt->head.next = b;
+}
+
+// Remove b from the list it is on.
+// Caller must hold the lock of b's bucket.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Put b on the replacement list of its queue, at the most
+// recently used end if recent, else at the oldest end.
+// Caller must hold bcache.lock.
+static void
+lpush(struct buf *b, int recent)
+{
+  struct buf *l;
+
+  l = &bcache.q[b->queue];
+  if(recent){
+    b->lprev = l;
+    b->lnext = l->lnext;
+  } else {
+    b->lprev = l->lprev;
+    b->lnext = l;
+  }
+  b->lprev->lnext = b;
+  b->lnext->lprev = b;
+  bcache.nq[b->queue]++;
+}
+
+// Take b off its replacement list, if it is on one.
+// Caller must hold bcache.lock.
+static void
+lunlink(struct buf *b)
+{
+  if(b->lnext == 0)
+    return;
+  b->lnext->lprev = b->lprev;
+  b->lprev->lnext = b->lnext;
+  b->lprev = b->lnext = 0;
+  bcache.nq[b->queue]--;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bkt;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i <= BQ_AM; i++){
+    bcache.q[i].lprev = &bcache.q[i];
+    bcache.q[i].lnext = &bcache.q[i];
+  }
+  for(i = 0; i < NGHOST; i++){
+    bcache.ghost[i].dev = -1;
+    bcache.ghash[i] = -1;
+  }
+  for(bkt = bcache.bucket; bkt < bcache.bucket+NBUCKET; bkt++){
+    initlock(&bkt->lock, "bcache.bucket");
+    bkt->head.prev = &bkt->head;
+    bkt->head.next = &bkt->head;
+  }
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+// Add a page worth of buffers to the cache.
+// Returns one of them, on no bucket and marked B_BUSY,
+// or 0 if the cache is at NBUF or memory is short.
+// Caller must hold bcache.lock.
+static struct buf*
+bgrow(void)
+{
+  struct bucket *bkt;
+  struct buf *b;
+  uchar *mem;
+  int i;
+
+  for(i = 0; i < NBUF/BPP; i++)
+    if(bcache.page[i] == 0)
+      break;
+  if(i == NBUF/BPP || (mem = (uchar*)kalloc()) == 0)
+    return 0;
+  bcache.page[i] = mem;
+  bcache.nbuf += BPP;
+
+  for(b = &bcache.buf[i*BPP]; b < &bcache.buf[i*BPP+BPP]; b++){
+    b->data = mem;
+    mem += BSIZE;
     b->dev = -1;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->blockno = 0;
+    b->flags = 0;
+    b->queue = BQ_NONE;
+    b->lprev = b->lnext = 0;
+    if(b == &bcache.buf[i*BPP])
+      continue;
+    bkt = BBUCKET(b);
+    acquire(&bkt->lock);
+    bpush(bkt, b);
+    release(&bkt->lock);
+    lpush(b, 1);
+  }
+  b = &bcache.buf[i*BPP];
+  b->flags = B_BUSY;
+  return b;
+}
+
+// Called by kalloc() when it is out of memory.
+// Take a page of buffers that are all idle out of the
+// cache and free it.  Returns 1 if a page was freed.
+int
+bshrink(void)
+{
+  struct bucket *bkt;
+  struct buf *b, *first;
+  int i;
+
+  // A process growing the cache is the one calling kalloc().
+  if(holding(&bcache.lock))
+    return 0;
+
+  acquire(&bcache.lock);
+  for(i = 0; i < NBUF/BPP; i++){
+    if(bcache.page[i] == 0)
+      continue;
+    first = &bcache.buf[i*BPP];
+
+    // Claim each buffer of the page, backing out if one is in use
+    // or still has to be written back.
+    // A claimed buffer is off its bucket, so no one can be
+    // sleeping on it.
+    for(b = first; b < first+BPP; b++){
+      bkt = BBUCKET(b);
+      acquire(&bkt->lock);
+      if(b->flags & (B_BUSY|B_DIRTY)){
+        release(&bkt->lock);
+        break;
+      }
+      bunlink(b);
+      b->flags |= B_BUSY;
+      release(&bkt->lock);
+    }
+    if(b < first+BPP){
+      while(--b >= first){
+        bkt = BBUCKET(b);
+        acquire(&bkt->lock);
+        bpush(bkt, b);
+        b->flags &= ~B_BUSY;
+        release(&bkt->lock);
+      }
+      continue;
+    }
+
+    for(b = first; b < first+BPP; b++){
+      lunlink(b);
+      b->queue = BQ_NONE;
+      b->data = 0;
+    }
+    kfree((char*)bcache.page[i]);
+    bcache.page[i] = 0;
+    bcache.nbuf -= BPP;
+    release(&bcache.lock);
+    return 1;
   }
+  release(&bcache.lock);
+  return 0;
 }
 
-// Look through buffer cache for sector on device dev.
+// Is any buffer free but dirty, and not held back by the log?
+// Caller must hold bcache.lock.
+static int
+bdirty(void)
+{
+  struct bucket *bkt;
+  struct buf *b;
+  int dirty;
+
+  dirty = 0;
+  for(bkt = bcache.bucket; bkt < bcache.bucket+NBUCKET && !dirty; bkt++){
+    acquire(&bkt->lock);
+    for(b = bkt->head.next; b != &bkt->head; b = b->next)
+      if((b->flags & (B_BUSY|B_DIRTY|B_LOGGED)) == B_DIRTY)
+        dirty = 1;
+    release(&bkt->lock);
+  }
+  return dirty;
+}
+
+// Remember that the block in b was recycled from A1in, in the
+// ghost slot that has been there longest.
+// Caller must hold bcache.lock.
+static void
+bghostadd(struct buf *b)
+{
+  int g, *pp;
+
+  g = bcache.ghostnext;
+  bcache.ghostnext = (g + 1) % NGHOST;
+  if(bcache.ghost[g].dev != -1){
+    pp = &bcache.ghash[GHASH(bcache.ghost[g].dev, bcache.ghost[g].blockno)];
+    while(*pp != g)
+      pp = &bcache.ghost[*pp].next;
+    *pp = bcache.ghost[g].next;
+  }
+  bcache.ghost[g].dev = b->dev;
+  bcache.ghost[g].blockno = b->blockno;
+  pp = &bcache.ghash[GHASH(b->dev, b->blockno)];
+  bcache.ghost[g].next = *pp;
+  *pp = g;
+}
+
+// Take the oldest buffer on list q that is free and clean,
+// requeueing the ones passed over as described above, off its
+// bucket and its list, and mark it B_BUSY.  Gives up after
+// going around the list twice, once to clear B_REF.
+// Caller must hold bcache.lock.
+static struct buf*
+bpick(int q)
+{
+  struct bucket *bkt;
+  struct buf *b, *l;
+  int n;
+
+  l = &bcache.q[q];
+  for(n = 2*bcache.nq[q]; n > 0; n--){
+    b = l->lprev;
+    // Only bget() under bcache.lock changes which bucket
+    // a buffer is on, so BBUCKET(b) is stable.
+    bkt = BBUCKET(b);
+    acquire(&bkt->lock);
+    if((b->flags & (B_BUSY|B_DIRTY)) || (q == BQ_AM && (b->flags & B_REF))){
+      b->flags &= ~B_REF;
+      release(&bkt->lock);
+      lunlink(b);
+      lpush(b, 1);
+      continue;
+    }
+    bunlink(b);
+    b->flags = B_BUSY;
+    release(&bkt->lock);
+    lunlink(b);
+    return b;
+  }
+  return 0;
+}
+
+// Choose a clean free buffer to recycle: an empty one if any,
+// else the oldest on A1in if A1in is over its share or Am
+// has none, else the least recently used on Am.
+// Take it off its bucket and mark it B_BUSY.
+// Returns 0 if there is none; then *dirty says whether
+// writing back dirty buffers would free some.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(int *dirty)
+{
+  struct buf *b;
+  int q;
+
+  if((b = bpick(BQ_NONE)) == 0){
+    q = BQ_AM;
+    if(bcache.nq[BQ_A1IN] > bcache.nbuf/4 || bcache.nq[BQ_AM] == 0)
+      q = BQ_A1IN;
+    if((b = bpick(q)) == 0 && (b = bpick(q == BQ_AM ? BQ_A1IN : BQ_AM)) == 0){
+      *dirty = bdirty();
+      return 0;
+    }
+  }
+  if(b->queue == BQ_A1IN)
+    bghostadd(b);
+  b->queue = BQ_NONE;
+  return b;
+}
+
+// Was the block recycled from A1in lately?  If so, forget it,
+// since it is about to be cached again.
+// Caller must hold bcache.lock.
+static int
+bghost(uint dev, uint blockno)
+{
+  int *pp;
+
+  for(pp = &bcache.ghash[GHASH(dev, blockno)]; *pp != -1; pp = &bcache.ghost[*pp].next){
+    if(bcache.ghost[*pp].dev == dev && bcache.ghost[*pp].blockno == blockno){
+      bcache.ghost[*pp].dev = -1;
+      *pp = bcache.ghost[*pp].next;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A buffer has become free: wake a bget() waiting for one.
+// bget() counts itself in waiting before it last looks for a
+// free buffer, and holds bcache.lock from then until it sleeps;
+// so if it did not see this buffer, this sees it waiting.
+static void
+bwakeup(void)
+{
+  if(bcache.waiting){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
+// Look through buffer cache for block blockno on device dev.
 // If not found, allocate fresh block.
 // In either case, return locked buffer.
 static struct buf*
-bget(uint dev, uint sector)
+bget(uint dev, uint blockno)
 {
+  struct bucket *bkt;
   struct buf *b;
+  int dirty;
 
-  acquire(&bcache.lock);
+  bkt = &bcache.bucket[BHASH(dev, blockno)];
+
+ start:
+  acquire(&bkt->lock);
 
  loop:
   // Try for cached block.
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->sector == sector){
+  for(b = bkt->head.next; b != &bkt->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
       if(!(b->flags & B_BUSY)){
         b->flags |= B_BUSY;
-        release(&bcache.lock);
+        bkt->hits++;
+        release(&bkt->lock);
         return b;
       }
-      sleep(b, &bcache.lock);
+      sleep(b, &bkt->lock);
       goto loop;
     }
   }
+  release(&bkt->lock);
 
-  // Allocate fresh block.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0){
-      b->dev = dev;
-      b->sector = sector;
-      b->flags = B_BUSY;
+  // Allocate fresh block: grow the cache if it may,
+  // else recycle the least recently used free buffer.
+  // Holding bcache.lock keeps any other process from
+  // caching this block until we are done.
+  acquire(&bcache.lock);
+  acquire(&bkt->lock);
+  for(b = bkt->head.next; b != &bkt->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      // Cached by another process while no lock was held.
       release(&bcache.lock);
-      return b;
+      goto loop;
     }
   }
-  panic("bget: no buffers");
+  release(&bkt->lock);
+
+  bcache.waiting++;
+  if((b = bgrow()) == 0 && (b = bvictim(&dirty)) == 0){
+    if(dirty){
+      // Free buffers are all dirty: write them back.
+      bcache.waiting--;
+      release(&bcache.lock);
+      bflush();
+      goto start;
+    }
+    // Every buffer is in use: wait for a brelse.
+    sleep(&bcache, &bcache.lock);
+    bcache.waiting--;
+    release(&bcache.lock);
+    goto start;
+  }
+  bcache.waiting--;
+
+  b->dev = dev;
+  b->blockno = blockno;
+  if(BCACHE2Q && !bghost(dev, blockno))
+    b->queue = BQ_A1IN;
+  else
+    b->queue = BQ_AM;
+  lpush(b, 1);
+  bcache.misses++;
+  acquire(&bkt->lock);
+  bpush(bkt, b);
+  release(&bkt->lock);
+  release(&bcache.lock);
+  return b;
+}
+
+// Return a B_BUSY buf with the contents of the indicated disk block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
 }
 
-// Return a B_BUSY buf with the contents of the indicated disk sector.
+// Return a B_BUSY buf for the indicated disk block, having
+// started to read its contents if they are not cached.
+// Call bwait before using the contents, or before brelse.
+// Queueing several reads before waiting keeps the disk busy.
 struct buf*
-bread(uint dev, uint sector)
+bread_async(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, sector);
+  b = bget(dev, blockno);
   if(!(b->flags & B_VALID))
-    iderw(b);
+    idesubmit(b);
   return b;
 }
 
+// Return a B_BUSY buf for the indicated disk block without
+// reading it from disk, for a caller that will overwrite all
+// of it.  If the block is not cached, the contents are garbage.
+struct buf*
+boverwrite(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Wait for b's contents, read by bread_async, to arrive.
+void
+bwait(struct buf *b)
+{
+  if((b->flags & B_BUSY) == 0)
+    panic("bwait");
+  // Cached, perhaps dirty: no read was queued.
+  if(!(b->flags & B_VALID))
+    ideawait(b);
+}
+
+// Return a B_BUSY buf for the indicated disk block if it is
+// cached, or 0 if it is not.  Never reads or recycles a buffer.
+struct buf*
+bpeek(uint dev, uint blockno)
+{
+  struct bucket *bkt;
+  struct buf *b;
+
+  bkt = &bcache.bucket[BHASH(dev, blockno)];
+  acquire(&bkt->lock);
+ loop:
+  for(b = bkt->head.next; b != &bkt->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      if(!(b->flags & B_BUSY)){
+        b->flags |= B_BUSY;
+        release(&bkt->lock);
+        return b;
+      }
+      sleep(b, &bkt->lock);
+      goto loop;
+    }
+  }
+  release(&bkt->lock);
+  return 0;
+}
+
+// Start reading the indicated disk block into the cache
+// unless it is there already.  Does not wait for the read.
+void
+breada(uint dev, uint blockno)
+{
+  struct bucket *bkt;
+  struct buf *b;
+
+  bkt = &bcache.bucket[BHASH(dev, blockno)];
+  acquire(&bkt->lock);
+  for(b = bkt->head.next; b != &bkt->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bkt->lock);
+      return;
+    }
+  }
+  release(&bkt->lock);
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID)
+    brelse(b);
+  else {
+    b->flags |= B_ASYNC;
+    idesubmit(b);
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
+// With WRITEBACK, only mark b dirty; bflush writes it later,
+// so repeated writes of one block cost a single disk write.
 void
 bwrite(struct buf *b)
 {
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  if(!WRITEBACK)
+    iderw(b);
 }
 
 // Release the buffer b.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bkt;
+
   if((b->flags & B_BUSY) == 0)
     panic("brelse");
 
-  acquire(&bcache.lock);
+  bkt = BBUCKET(b);
+  acquire(&bkt->lock);
 
-  b->next->prev = b->prev;
-  b->prev->next = b->next;
-  b->next = bcache.head.next;
-  b->prev = &bcache.head;
-  bcache.head.next->prev = b;
-  bcache.head.next = b;
+  bunlink(b);
+  bpush(bkt, b);
+  // Only Am cares; bvictim requeues b if it is at the end.
+  b->flags |= B_REF;
 
   b->flags &= ~B_BUSY;
   wakeup(b);
 
-  release(&bcache.lock);
+  release(&bkt->lock);
+  bwakeup();
 }
 
+// Claim up to NFLUSH dirty free buffers, leaving them in place
+// so that bget() finds them and waits.  Returns how many.
+static int
+bclaimdirty(struct buf **list)
+{
+  struct bucket *bkt;
+  struct buf *b;
+  int n;
+
+  n = 0;
+  for(bkt = bcache.bucket; bkt < bcache.bucket+NBUCKET && n < NFLUSH; bkt++){
+    acquire(&bkt->lock);
+    for(b = bkt->head.next; b != &bkt->head && n < NFLUSH; b = b->next){
+      if((b->flags & (B_BUSY|B_DIRTY|B_LOGGED)) == B_DIRTY){
+        b->flags |= B_BUSY;
+        list[n++] = b;
+      }
+    }
+    release(&bkt->lock);
+  }
+  return n;
+}
+
+// Write every dirty buffer not in use back to disk,
+// except those the log has not committed.
+// Each batch goes out in block order to keep the disk
+// head moving one way.
+void
+bflush(void)
+{
+  struct buf *list[NFLUSH], *b;
+  struct bucket *bkt;
+  int i, j, n;
+
+  do {
+    n = bclaimdirty(list);
+
+    for(i = 1; i < n; i++){
+      b = list[i];
+      for(j = i; j > 0 && (list[j-1]->dev > b->dev ||
+          (list[j-1]->dev == b->dev && list[j-1]->blockno > b->blockno)); j--)
+        list[j] = list[j-1];
+      list[j] = b;
+    }
+
+    for(i = 0; i < n; i++)
+      idesubmit(list[i]);
+    for(i = 0; i < n; i++){
+      b = list[i];
+      ideawait(b);
+      // Unlike brelse, leave b's place in the LRU order alone.
+      bkt = BBUCKET(b);
+      acquire(&bkt->lock);
+      b->flags &= ~B_BUSY;
+      wakeup(b);
+      release(&bkt->lock);
+    }
+    if(n > 0)
+      bwakeup();
+  } while(n == NFLUSH);
+}
+
+// Print buffer cache statistics to the console, for
+// comparing replacement policies.  Runs when user
+// types ^P on console.  No lock, like procdump.
+void
+bdump(void)
+{
+  struct bucket *bkt;
+  uint hits;
+
+  hits = 0;
+  for(bkt = bcache.bucket; bkt < bcache.bucket+NBUCKET; bkt++)
+    hits += bkt->hits;
+  cprintf("bcache %s: %d bufs, %d on A1in, %d hits, %d misses\n",
+          BCACHE2Q ? "2Q" : "LRU", bcache.nbuf, bcache.nq[BQ_A1IN], hits, bcache.misses);
+}
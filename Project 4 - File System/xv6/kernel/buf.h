@@ -4,15 +4,25 @@
 struct buf {
   int flags;
   uint dev;
-  uint sector;
-  struct buf *prev; // LRU cache list
+  uint blockno;
+  int queue;        // BQ_A1IN or BQ_AM, for 2Q replacement
+  struct buf *prev; // LRU list of its hash bucket
   struct buf *next;
+  struct buf *lprev; // replacement list of its queue
+  struct buf *lnext;
   struct buf *qnext; // disk queue
-  uchar data[512];
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // ideintr releases buffer when its read is done
+#define B_LOGGED 0x10 // changed by a transaction not yet committed
+#define B_REF   0x20  // released since bvictim last passed it
+
+#define BQ_NONE 0  // buffer holds no block
+#define BQ_A1IN 1  // block used once lately
+#define BQ_AM   2  // block used again after leaving A1in
 
 #endif // _BUF_H_
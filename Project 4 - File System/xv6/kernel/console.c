@@ -8,6 +8,7 @@
 #include "traps.h"
 #include "spinlock.h"
 #include "fs.h"
+#include "sleeplock.h"
 #include "file.h"
 #include "mmu.h"
 #include "proc.h"
@@ -188,6 +189,7 @@ consoleintr(int (*getc)(void))
     switch(c){
     case C('P'):  // Process listing.
       procdump();
+      bdump();
       break;
     case C('U'):  // Kill line.
       while(input.e != input.w &&
@@ -231,7 +233,7 @@ consoleread(struct inode *ip, char *dst, int n)
     while(input.r == input.w){
       if(proc->killed){
         release(&input.lock);
-        ilock(ip);
+        ilockshared(ip);
         return -1;
       }
       sleep(&input.r, &input.lock);
@@ -251,7 +253,7 @@ consoleread(struct inode *ip, char *dst, int n)
       break;
   }
   release(&input.lock);
-  ilock(ip);
+  ilockshared(ip);
 
   return target - n;
 }
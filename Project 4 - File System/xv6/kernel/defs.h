@@ -7,13 +7,24 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct sleeplock;
 struct spinlock;
 struct stat;
+struct statfs;
+struct superblock;
 
 // bio.c
+void            bdump(void);
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_async(uint, uint);
 void            brelse(struct buf*);
+void            bflush(void);
+struct buf*     bpeek(uint, uint);
+struct buf*     boverwrite(uint, uint);
+void            breada(uint, uint);
+int             bshrink(void);
+void            bwait(struct buf*);
 void            bwrite(struct buf*);
 
 // console.c
@@ -30,19 +41,26 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             filepread(struct file*, char*, int n, uint off);
+int             filepwrite(struct file*, char*, int n, uint off);
 int             fileread(struct file*, char*, int n);
+int             fileseek(struct file*, int off, int whence);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 int             getFilesByTag(char* key, char* value, int valueLength, char* results, int resultsLength);
 
 // fs.c
 int             dirlink(struct inode*, char*, uint);
+int             dirroom(struct inode*, char*);
+void            dcacheset(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit(void);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
+void            itrunc(struct inode*, uint);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -50,6 +68,11 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            fsflushd(void);
+void            fsinit(int);
+void            fsstat(struct statfs*);
+void            fssync(void);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 int             tagFile(int fileDescriptor, char* key, char* value, int valueLength);
@@ -58,10 +81,22 @@ int             getFileTag(int fileDescriptor, char* key, char* buffer, int leng
 int             getAllTags(int fileDescriptor, struct Key keys[], int maxTags);
 int             readBuf(struct file* f, char* key, char* value, int valueLength, char* results, int resultsLength);
 
+// log.c
+void            initlog(int, struct superblock*);
+void            log_write(struct buf*);
+void            begin_op(void);
+void            end_op(void);
+void            logsync(void);
+void            logrevoke(uint);
+int             logrevoked(uint*);
+uint            logcommits(void);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            ideawait(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -90,6 +125,15 @@ int             mpbcpu(void);
 void            mpinit(void);
 void            mpstartthem(void);
 
+// pcache.c
+void            pagedrop(struct inode*, uint);
+void            pagedup(char*);
+char*           pageget(struct inode*, uint);
+void            pageinit(void);
+void            pageput(char*);
+int             pageshrink(void);
+void            pagewrite(struct inode*, char*, uint, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -106,6 +150,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kproc(char*, void(*)(void));
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
@@ -119,6 +164,13 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// sleeplock.c
+void            acquiresleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+int             holdingsleep(struct sleeplock*);
+void            initsleeplock(struct sleeplock*, char*);
+void            releasesleep(struct sleeplock*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -141,6 +193,7 @@ int             searchEnd(uchar* str);
 
 // syscall.c
 int             argint(int, int*);
+int             argoutptr(int, char**, int);
 int             argptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(struct proc*, uint, int*);
@@ -172,6 +225,8 @@ int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
+int             mmapuvm(pde_t*, char*, struct inode*, uint, uint);
+int             uvmwritable(pde_t*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
@@ -2,8 +2,11 @@
 #include "defs.h"
 #include "param.h"
 #include "fs.h"
-#include "file.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "stat.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -14,7 +17,11 @@ struct {
 void
 fileinit(void)
 {
+  struct file *f;
+
   initlock(&ftable.lock, "ftable");
+  for(f = ftable.file; f < ftable.file + NFILE; f++)
+    initsleeplock(&f->lock, "file");
 }
 
 // Allocate a file structure.
@@ -67,8 +74,11 @@ fileclose(struct file *f)
   
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
-  else if(ff.type == FD_INODE)
+  else if(ff.type == FD_INODE){
+    begin_op();
     iput(ff.ip);
+    end_op();
+  }
 }
 
 // Get metadata about file f.
@@ -76,7 +86,7 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, st);
     iunlock(f->ip);
     return 0;
@@ -84,6 +94,46 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// About to read n bytes from f.  If f is being read
+// sequentially, start reading those bytes and the next
+// f->rawin blocks into the buffer cache, doubling the
+// window each time up to NREADAHEAD blocks.
+// Caller must hold f->ip's lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint bn, end;
+
+  if(f->off != f->raoff){
+    f->rawin = 0;
+    f->rablock = 0;
+    return;
+  }
+  if(f->rawin == 0)
+    f->rawin = 4;
+  else if(f->rawin < NREADAHEAD)
+    f->rawin *= 2;
+
+  bn = f->off/BSIZE;
+  end = (f->off + n + BSIZE-1)/BSIZE + f->rawin;
+  if(bn < f->rablock)
+    bn = f->rablock;
+  if(bn < end){
+    ireadahead(f->ip, bn, end - bn);
+    f->rablock = end;
+  }
+}
+
+// Read n bytes at off from inode ip, or none past its end.
+// Caller must hold ip's lock.
+static int
+readat(struct inode *ip, char *addr, int n, uint off)
+{
+  if(ip->type != T_DEV && off >= ip->size)
+    return 0;
+  return readi(ip, addr, off, n);
+}
+
 // Read from file f.  Addr is kernel address.
 int
 fileread(struct file *f, char *addr, int n)
@@ -95,35 +145,116 @@ fileread(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
+    // Readers of other files open on the inode share its
+    // lock; f->lock keeps those sharing f from using the
+    // same f->off.
+    acquiresleep(&f->lock);
+    ilockshared(f->ip);
+    readahead(f, n);
+    if((r = readat(f->ip, addr, n, f->off)) > 0)
       f->off += r;
+    f->raoff = f->off;
     iunlock(f->ip);
+    releasesleep(&f->lock);
     return r;
   }
   panic("fileread");
 }
 
-// Write to file f.  Addr is kernel address.
+// Read from file f at offset off, leaving f->off alone.
 int
-filewrite(struct file *f, char *addr, int n)
+filepread(struct file *f, char *addr, int n, uint off)
 {
   int r;
 
-  if(f->writable == 0)
+  if(f->readable == 0 || f->type != FD_INODE)
     return -1;
-  if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
-  if(f->type == FD_INODE){
+  ilockshared(f->ip);
+  r = readat(f->ip, addr, n, off);
+  iunlock(f->ip);
+  return r;
+}
+
+// Write n bytes at *off in inode file f, advancing *off
+// past what each transaction writes while holding the lock.
+static int
+writeat(struct file *f, char *addr, int n, uint *off)
+{
+  int r, i, m, max;
+
+  // Write a few blocks at a time, each in its own
+  // transaction, so that what one writes fits in the log:
+  // the i-node, indirect and bitmap blocks for each block,
+  // 2 blocks of slop for non-aligned writes, and 2 bitmap
+  // blocks for switching an extent file to block addresses.
+  max = ((MAXOPBLOCKS-1-1-2-2) / 2) * BSIZE;
+  for(i = 0; i < n; i += r){
+    m = n - i;
+    if(m > max)
+      m = max;
+    begin_op();
     ilock(f->ip);
-    if((r = writei(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
+    if((r = writei(f->ip, addr + i, *off, m)) > 0)
+      *off += r;
     iunlock(f->ip);
-    return r;
+    end_op();
+    if(r < 0)
+      return i > 0 ? i : -1;
+    if(r < m)
+      return i + r;
   }
+  return n;
+}
+
+// Write to file f.  Addr is kernel address.
+int
+filewrite(struct file *f, char *addr, int n)
+{
+  if(f->writable == 0)
+    return -1;
+  if(f->type == FD_PIPE)
+    return pipewrite(f->pipe, addr, n);
+  if(f->type == FD_INODE)
+    return writeat(f, addr, n, &f->off);
   panic("filewrite");
 }
 
+// Write to file f at offset off, leaving f->off alone.
+int
+filepwrite(struct file *f, char *addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return writeat(f, addr, n, &off);
+}
+
+// Set f->off to off plus the start, current offset or end
+// of f, as whence is SEEK_SET, SEEK_CUR or SEEK_END.
+// Returns the new offset, or -1 if it would be negative.
+int
+fileseek(struct file *f, int off, int whence)
+{
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  acquiresleep(&f->lock);
+  ilockshared(f->ip);
+  if(whence == SEEK_SET)
+    r = off;
+  else if(whence == SEEK_CUR)
+    r = f->off + off;
+  else if(whence == SEEK_END)
+    r = f->ip->size + off;
+  else
+    r = -1;
+  if(r >= 0)
+    f->off = r;
+  iunlock(f->ip);
+  releasesleep(&f->lock);
+  return r < 0 ? -1 : r;
+}
+
 int
 getFilesByTag(char* key, char* value, int valueLength, char* results, int resultsLength)
 {
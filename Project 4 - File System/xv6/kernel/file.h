@@ -8,6 +8,10 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint raoff;    // off at which a sequential read would start
+  uint rawin;    // blocks to read ahead; 0 after a random read
+  uint rablock;  // blocks before this have been read ahead
+  struct sleeplock lock;  // held by reads, which use off
 };
 
 
@@ -17,18 +21,36 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  int flags;          // I_BUSY, I_VALID
+  struct sleeplock lock;  // the inode lock; see fs.c
+  int flags;          // I_VALID
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint dflags;        // DI_ flags of disk inode
+  union {
+    uint addrs[NDIRECT+3];
+    char data[NINLINE];
+  };
   uint tags;
+
+  struct spinlock maplock;  // mapbn and map, which shared holders update
+  uint mapbn;         // first file block held in map
+  uint map[NBMAP];    // addresses from the last indirect block read
+  uint bnear;         // last block allocated to the file, or 0
+
+  char *dblock[NDWIN];  // delayed allocation window: blocks
+  uint dbn;           // dbn..dbn+dn-1, not yet given disk blocks
+  uint dn;
+  uint dgen;          // iflushall pass that last flushed it
+
+  struct inode *hnext;  // hash chain in icache
+  struct inode *prev;   // list of unreferenced inodes
+  struct inode *next;
 };
 
-#define I_BUSY 0x1
 #define I_VALID 0x2
 
 
@@ -1,10 +1,15 @@
-// File system implementation.  Four layers:
+// File system implementation.  Five layers:
 //   + Blocks: allocator for raw disk blocks.
+//   + Log: crash recovery for multi-step updates.
 //   + Files: inode allocator, reading, writing, metadata.
 //   + Directories: inode with special contents (list of other inodes!)
 //   + Names: paths like /usr/rtm/xv6/fs.c for convenient naming.
 //
-// Disk layout is: superblock, inodes, block in-use bitmap, data blocks.
+// Disk layout is: superblock, log, then groups of inodes,
+// block in-use bitmap, data blocks.
+//
+// Metadata blocks are written with log_write, so callers
+// must be inside a transaction, between begin_op and end_op.
 //
 // This file contains the low-level file system manipulation 
 // routines.  The (higher-level) system call implementations
@@ -17,12 +22,48 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "x86.h"
 #include "buf.h"
 #include "fs.h"
+#include "sleeplock.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-static void itrunc(struct inode*);
+#define NRBATCH 8  // blocks readi queues before waiting for any
+#define NCOLOR 8   // places in a group where files start
+static void dcacheinit(void);
+static void dcachepurge(uint, uint);
+static void iflush(struct inode*);
+static void iflushall(void);
+
+// The superblock of the root file system, read once by
+// fsinit.  Only the free counts change; lock protects them.
+// They are written back to disk lazily, by sbsync.
+// imap, built by fsinit, has a bit set for each inode in use
+// (and for the numbers past ninodes that fill its last word),
+// so that ialloc need not read inode blocks to find a free one.
+// Each allocation group has its own lock for its free count
+// and next-fit position; its bitmap block is only changed while
+// holding the buffer.  So is pend, which has a bit set for each
+// block freed since commit number pseq: until that commit, the
+// old owner still has the block on the disk, so balloc must not
+// hand it out.
+struct group {
+  struct spinlock lock;
+  uint nfree;  // free blocks in the group
+  uint bnext;  // where balloc next looks in the group
+  uint *pend;  // blocks freed but not yet committed
+  uint pseq;   // logcommits() when pend was started
+  uint npend;  // bits set in pend
+};
+
+static struct {
+  struct spinlock lock;
+  struct superblock sb;
+  int dirty;  // free counts differ from the disk copy
+  uint *imap; // in-use inode bitmap; protected by lock
+  struct group g[NGROUP];
+} fsb;
 
 // Read the super block.
 static void
@@ -35,42 +76,299 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Zero a block.
+// Load the superblock of dev, the root file system.
+// Called by the first process to run, since it
+// must sleep waiting for the disk.  Starts fsflushd
+// once the file system is ready for it.
+void
+fsinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  struct group *gp;
+  uint inum, nfree, g, i;
+
+  initlock(&fsb.lock, "superblock");
+  readsb(dev, &fsb.sb);
+  // Block 1 of a file system with other-sized blocks is
+  // somewhere else, so this is usually garbage there.
+  if(fsb.sb.bsize != BSIZE)
+    panic("fsinit: block size");
+  initlog(dev, &fsb.sb);
+
+  if(fsb.sb.ngroups > NGROUP || fsb.sb.bpg > BPB || fsb.sb.ipg%IPB != 0)
+    panic("fsinit: groups");
+  nfree = 0;
+  for(g = 0; g < fsb.sb.ngroups; g++){
+    gp = &fsb.g[g];
+    initlock(&gp->lock, "group");
+    bp = bread(dev, GSTART(g, fsb.sb) + fsb.sb.ipg/IPB);
+    for(i = 0; i < fsb.sb.bpg; i++)
+      if((bp->data[i/8] & (1 << (i%8))) == 0)
+        gp->nfree++;
+    brelse(bp);
+    gp->bnext = GSTART(g, fsb.sb) + fsb.sb.ipg/IPB + 1;
+    nfree += gp->nfree;
+    if((gp->pend = (uint*)kalloc()) == 0)
+      panic("fsinit: pending map");
+    memset(gp->pend, 0, PGSIZE);
+    gp->npend = 0;
+  }
+  if(fsb.sb.nfreeblocks != nfree){
+    fsb.sb.nfreeblocks = nfree;
+    fsb.dirty = 1;
+  }
+
+  if(fsb.sb.ninodes > PGSIZE*8 || (fsb.imap = (uint*)kalloc()) == 0)
+    panic("fsinit: inode bitmap");
+  memset(fsb.imap, 0, PGSIZE);
+  fsb.imap[0] = 1;  // inode 0 is never used
+  // Numbers past the last inode look in use, so that
+  // ialloc never picks one from the last word.
+  for(inum = fsb.sb.ninodes; inum%32 != 0; inum++)
+    fsb.imap[inum/32] |= 1 << (inum%32);
+  nfree = 0;
+  for(inum = 1; inum < fsb.sb.ninodes; inum++){
+    if(inum == 1 || inum%IPB == 0){
+      if(inum != 1)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, fsb.sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0)
+      fsb.imap[inum/32] |= 1 << (inum%32);
+    else
+      nfree++;
+  }
+  brelse(bp);
+
+  // Having counted, trust the count over the superblock's.
+  if(fsb.sb.nfreeinodes != nfree){
+    fsb.sb.nfreeinodes = nfree;
+    fsb.dirty = 1;
+  }
+
+  kproc("fsflushd", fsflushd); // writes back superblock and buffers
+}
+
+// Adjust the free block and inode counts.
+static void
+sbcount(int nblocks, int ninodes)
+{
+  acquire(&fsb.lock);
+  fsb.sb.nfreeblocks += nblocks;
+  fsb.sb.nfreeinodes += ninodes;
+  fsb.dirty = 1;
+  release(&fsb.lock);
+}
+
+// Copy the free counts back to the superblock on dev.
 static void
-bzero(int dev, int bno)
+sbsync(int dev)
+{
+  struct buf *bp;
+
+  if(!fsb.dirty)
+    return;
+  // Copy while holding bp, so that concurrent calls
+  // cannot write an older copy over a newer one.
+  bp = bread(dev, 1);
+  acquire(&fsb.lock);
+  memmove(bp->data, &fsb.sb, sizeof(fsb.sb));
+  fsb.dirty = 0;
+  release(&fsb.lock);
+  bwrite(bp);
+  brelse(bp);
+}
+
+// Write everything the file system has delayed back to disk.
+void
+fssync(void)
+{
+  iflushall();
+  logsync();
+  sbsync(ROOTDEV);
+  bflush();
+}
+
+// Body of the fsflushd kernel process: every FLUSHTICKS
+// ticks, write back what the file system has delayed.
+void
+fsflushd(void)
+{
+  uint ticks0;
+
+  for(;;){
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < FLUSHTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    fssync();
+  }
+}
+
+// Report free space in the root file system.
+void
+fsstat(struct statfs *st)
+{
+  acquire(&fsb.lock);
+  st->bsize = BSIZE;
+  st->blocks = fsb.sb.size;
+  st->bfree = fsb.sb.nfreeblocks;
+  st->files = fsb.sb.ninodes;
+  st->ffree = fsb.sb.nfreeinodes;
+  release(&fsb.lock);
+}
+
+// Zero a block.  One that will hold metadata
+// is zeroed through the log, as it is written later.
+static void
+bzero(int dev, int bno, int meta)
 {
   struct buf *bp;
   
-  bp = bread(dev, bno);
+  bp = boverwrite(dev, bno);
   memset(bp->data, 0, BSIZE);
-  bwrite(bp);
+  if(meta)
+    log_write(bp);
+  else
+    bwrite(bp);
   brelse(bp);
 }
 
 // Blocks. 
 
-// Allocate a disk block.
+// Find a free block in bitmap map of a group, at or after bit
+// bit, wrapping around, skipping 32 in-use blocks at a time.
+// Return its bit, or -1 if there is none.
+static int
+gfree(uint *map, uint bit)
+{
+  uint i, k, nw, w;
+
+  nw = (fsb.sb.bpg + 31) / 32;
+  for(k = 0; k <= nw; k++){
+    i = (bit/32 + k) % nw;
+    w = map[i];
+    if(k == 0)
+      w |= (1 << (bit%32)) - 1;  // the blocks before bit
+    if(w == ~0)
+      continue;
+    i = i*32 + bsf(~w);
+    if(i < fsb.sb.bpg)
+      return i;
+  }
+  return -1;
+}
+
+// Claim a free block of group g, preferably block b.  If b is
+// taken, prefer the start of 8 free blocks after it, so that a
+// file whose next block another file took starts a new run
+// instead of alternating blocks with it.  Also claim the free
+// blocks after it, up to *n in all, and set *n to the number
+// claimed.  Return 0 if the group is full.  If wait is set,
+// blocks freed since the last commit count as in use.
 static uint
-balloc(uint dev)
+gscan(uint dev, uint g, uint b, uint *n, int wait)
 {
-  int b, bi, m;
+  uint start, bit, k, nb, nw, got, rv[LOGSIZE];
+  int i, nrv, pend;
+  uchar *map;
   struct buf *bp;
-  struct superblock sb;
-
-  bp = 0;
-  readsb(dev, &sb);
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb.ninodes));
-    for(bi = 0; bi < BPB; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use on disk.
-        bwrite(bp);
-        brelse(bp);
-        return b + bi;
-      }
+  struct group *gp;
+
+  start = GSTART(g, fsb.sb);
+  bit = b >= start && b < start + fsb.sb.bpg ? b - start : 0;
+  bp = bread(dev, start + fsb.sb.ipg/IPB);
+  map = bp->data;
+  gp = &fsb.g[g];
+
+  // While scanning, treat blocks freed since the last commit,
+  // and blocks the log says not to reuse yet, as in use; no one
+  // else sees map before brelse.  Both are free in map, so
+  // clearing their bits afterwards leaves it as it was.
+  nw = (fsb.sb.bpg + 31) / 32;
+  pend = wait && gp->npend > 0 && gp->pseq == logcommits();
+  if(pend)
+    for(k = 0; k < nw; k++)
+      ((uint*)map)[k] |= gp->pend[k];
+  nrv = logrevoked(rv);
+  for(k = 0; k < nrv; k++)
+    if(BGROUP(rv[k], fsb.sb) == g)
+      map[BBIT(rv[k], fsb.sb)/8] |= 1 << (BBIT(rv[k], fsb.sb)%8);
+
+  i = bit;
+  if(map[bit/8] & (1 << (bit%8))){
+    nb = fsb.sb.bpg / 8;
+    for(k = 1; k <= nb; k++)
+      if(map[(bit/8 + k) % nb] == 0)
+        break;
+    if(k <= nb)
+      i = (bit/8 + k) % nb * 8;
+    else
+      i = gfree((uint*)map, bit);
+  }
+  // Mark blocks in use on disk.
+  for(got = 0; i >= 0 && got < *n && i+got < fsb.sb.bpg; got++){
+    if(map[(i+got)/8] & (1 << ((i+got)%8)))
+      break;
+    map[(i+got)/8] |= 1 << ((i+got)%8);
+    // Without wait, a pending block may be taken: it is
+    // pending no longer, as it is in use in map.
+    if(gp->pend[(i+got)/32] & (1 << ((i+got)%32))){
+      gp->pend[(i+got)/32] &= ~(1 << ((i+got)%32));
+      gp->npend--;
     }
+  }
+
+  for(k = 0; k < nrv; k++)
+    if(BGROUP(rv[k], fsb.sb) == g)
+      map[BBIT(rv[k], fsb.sb)/8] &= ~(1 << (BBIT(rv[k], fsb.sb)%8));
+  if(pend)
+    for(k = 0; k < nw; k++)
+      ((uint*)map)[k] &= ~gp->pend[k];
+  if(i < 0){
     brelse(bp);
+    return 0;
+  }
+  log_write(bp);
+  brelse(bp);
+  *n = got;
+  acquire(&gp->lock);
+  gp->nfree -= got;
+  gp->bnext = start + i + got;
+  release(&gp->lock);
+  sbcount(-got, 0);
+  return start + i;
+}
+
+// Allocate a disk block, as soon after block near as there is
+// a free one: first in near's group, then in the groups after
+// it, starting where the last allocation there left off.
+// Take up to *n blocks in a row, setting *n to the number taken.
+// Blocks freed since the last commit are taken only when there
+// are no others: an operation cannot wait for a commit, and
+// risking the old owner's contents after a crash beats failing.
+static uint
+balloc(uint dev, uint near, uint *nb)
+{
+  uint g, n, b;
+  int wait;
+  struct group *gp;
+
+  for(wait = 1; wait >= 0; wait--){
+    g = BGROUP(near, fsb.sb);
+    for(n = 0; n < fsb.sb.ngroups; n++, g = (g + 1) % fsb.sb.ngroups){
+      gp = &fsb.g[g];
+      acquire(&gp->lock);
+      b = n == 0 ? near + 1 : gp->bnext;
+      if(gp->nfree == 0)
+        b = 0;
+      release(&gp->lock);
+      if(b != 0 && (b = gscan(dev, g, b, nb, wait)) != 0)
+        return b;
+    }
   }
   panic("balloc: out of blocks");
 }
@@ -80,20 +378,33 @@ static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
-  struct superblock sb;
+  struct group *gp;
+  uint seq;
   int bi, m;
 
-  bzero(dev, b);
-
-  readsb(dev, &sb);
-  bp = bread(dev, BBLOCK(b, sb.ninodes));
-  bi = b % BPB;
+  bp = bread(dev, BBLOCK(b, fsb.sb));
+  bi = BBIT(b, fsb.sb);
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
+  logrevoke(b);
   bp->data[bi/8] &= ~m;  // Mark block free on disk.
-  bwrite(bp);
+  log_write(bp);
+  // Keep b from balloc until the commit that frees it.
+  gp = &fsb.g[BGROUP(b, fsb.sb)];
+  seq = logcommits();
+  if(gp->pseq != seq || gp->npend == 0){
+    memset(gp->pend, 0, (fsb.sb.bpg + 31) / 32 * 4);
+    gp->pseq = seq;
+    gp->npend = 0;
+  }
+  gp->pend[bi/32] |= 1 << (bi%32);
+  gp->npend++;
   brelse(bp);
+  acquire(&gp->lock);
+  gp->nfree++;
+  release(&gp->lock);
+  sbcount(1, 0);
 }
 
 // Inodes.
@@ -110,15 +421,20 @@ bfree(int dev, uint b)
 // 
 // ip->ref counts the number of pointer references to this cached
 // inode; references are typically kept in struct file and in proc->cwd.
-// When ip->ref falls to zero, the inode is no longer cached.
+// When ip->ref falls to zero, the inode stays cached, on a list of
+// unreferenced inodes, until iget needs to recycle it.
 // It is an error to use an inode without holding a reference to it.
 //
 // Processes are only allowed to read and write inode
 // metadata and contents when holding the inode's lock,
-// represented by the I_BUSY flag in the in-memory copy.
-// Because inode locks are held during disk accesses, 
-// they are implemented using a flag rather than with
-// spin locks.  Callers are responsible for locking
+// ip->lock.  Because inode locks are held during disk
+// accesses, they are sleep locks rather than spin locks.
+// ilock holds it exclusively; ilockshared holds it shared,
+// for callers that only read the inode and its contents,
+// such as readi, stati and dirlookup, so readers of one
+// file do not wait for each other.  The only thing they
+// change is the block map cache, under ip->maplock.
+// Callers are responsible for locking
 // inodes before passing them to routines in this file; leaving
 // this responsibility with the caller makes it possible for them
 // to create arbitrarily-sized atomic operations.
@@ -129,42 +445,129 @@ bfree(int dev, uint b)
 // responsibility to lock them before using them.  A non-zero
 // ip->ref keeps these unlocked inodes in the cache.
 
+// The cache is a hash table keyed on (dev, inum).  It starts
+// empty and grows a page of inodes at a time, up to NINODE.
+
+#define NIHASH 31  // hash chains
+#define IHASH(dev, inum) (((dev)*31 + (inum)) % NIHASH)
+#define IPG (PGSIZE / sizeof(struct inode))  // inodes per page
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // chains through hnext
+
+  // Inodes with ref 0, through prev/next.  Empty ones (inum 0,
+  // on no chain) come first, then the least recently used.
+  struct inode lru;
+  int ninode;  // inodes allocated so far
+
+  int ndalloc; // inodes with a delayed allocation window
+  uint dgen;   // iflushall passes so far
 } icache;
 
 void
 iinit(void)
 {
   initlock(&icache.lock, "icache");
+  icache.lru.prev = &icache.lru;
+  icache.lru.next = &icache.lru;
+  dcacheinit();
+}
+
+// Remove ip from the list of unreferenced inodes.
+static void
+ilruremove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// Put ip on the list of unreferenced inodes after at.
+static void
+ilruinsert(struct inode *at, struct inode *ip)
+{
+  ip->next = at->next;
+  ip->prev = at;
+  at->next->prev = ip;
+  at->next = ip;
+}
+
+// Add a page of empty inodes to the cache.
+// Returns 0 if the cache is at NINODE or memory is short.
+// Caller must hold icache.lock.
+static int
+igrow(void)
+{
+  struct inode *ip, *page;
+
+  if(icache.ninode + IPG > NINODE || (page = (struct inode*)kalloc()) == 0)
+    return 0;
+  memset(page, 0, PGSIZE);
+  for(ip = page; ip < page+IPG; ip++){
+    initsleeplock(&ip->lock, "inode");
+    initlock(&ip->maplock, "inode map");
+    ilruinsert(&icache.lru, ip);
+  }
+  icache.ninode += IPG;
+  return 1;
 }
 
 static struct inode* iget(uint dev, uint inum);
 
-// Allocate a new inode with the given type on device dev.
+// Allocate a new inode with the given type on device dev,
+// in the group of directory inode dir if it has room.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint dir)
 {
-  int inum;
+  uint inum, i, k, nw, w, first;
   struct buf *bp;
   struct dinode *dip;
-  struct superblock sb;
 
-  readsb(dev, &sb);
-  for(inum = 1; inum < sb.ninodes; inum++){  // loop over inode blocks
-    bp = bread(dev, IBLOCK(inum));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      bwrite(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
+  // Claim the first free inode number in imap at or after the
+  // start of dir's group, wrapping around.
+  first = dir / fsb.sb.ipg * fsb.sb.ipg;
+  acquire(&fsb.lock);
+  nw = (fsb.sb.ninodes + 31)/32;
+  for(k = 0; k <= nw; k++){
+    i = (first/32 + k) % nw;
+    w = fsb.imap[i];
+    if(k == 0)
+      w |= (1 << (first%32)) - 1;
+    if(w != ~0)
+      break;
   }
-  panic("ialloc: no inodes");
+  if(k > nw || (inum = i*32 + bsf(~w)) >= fsb.sb.ninodes)
+    panic("ialloc: no inodes");
+  fsb.imap[i] |= 1 << (inum%32);
+  fsb.sb.nfreeinodes--;
+  fsb.dirty = 1;
+  release(&fsb.lock);
+
+  bp = bread(dev, IBLOCK(inum, fsb.sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  if(INLINE && type != T_DEV)
+    dip->flags = DI_INLINE;
+  else if(EXTENTS && type != T_DEV)
+    dip->flags = DI_EXTENTS;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// Return inum, whose on-disk inode has been
+// marked free, to the in-memory inode bitmap.
+static void
+ifree(uint inum)
+{
+  acquire(&fsb.lock);
+  fsb.imap[inum/32] &= ~(1 << (inum%32));
+  fsb.sb.nfreeinodes++;
+  fsb.dirty = 1;
+  release(&fsb.lock);
 }
 
 // Copy inode, which has changed, from memory to disk.
@@ -174,15 +577,16 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum));
+  bp = bread(ip->dev, IBLOCK(ip->inum, fsb.sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  bwrite(bp);
+  dip->flags = ip->dflags;
+  memmove(dip->data, ip->data, sizeof(ip->data));
+  log_write(bp);
   brelse(bp);
 }
 
@@ -191,31 +595,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&icache.lock);
 
   // Try for cached inode.
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ilruremove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Allocate fresh inode.
-  if(empty == 0)
+  // Allocate fresh inode: an empty one, else grow the
+  // cache, else recycle the least recently used.
+  ip = icache.lru.next;
+  if((ip == &icache.lru || ip->inum != 0) && igrow())
+    ip = icache.lru.next;
+  if(ip == &icache.lru)
     panic("iget: no inodes");
+  ilruremove(ip);
+  if(ip->inum != 0){
+    for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->tags = 0;
+  ip->hnext = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
   release(&icache.lock);
 
   return ip;
@@ -227,12 +641,13 @@ struct inode*
 idup(struct inode *ip)
 {
   acquire(&icache.lock);
-  ip->ref++;
+  if(ip->ref++ == 0)
+    ilruremove(ip);
   release(&icache.lock);
   return ip;
 }
 
-// Lock the given inode.
+// Lock the given inode exclusively.
 void
 ilock(struct inode *ip)
 {
@@ -242,21 +657,20 @@ ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquire(&icache.lock);
-  while(ip->flags & I_BUSY)
-    sleep(ip, &icache.lock);
-  ip->flags |= I_BUSY;
-  release(&icache.lock);
+  acquiresleep(&ip->lock);
 
   if(!(ip->flags & I_VALID)){
-    bp = bread(ip->dev, IBLOCK(ip->inum));
+    bp = bread(ip->dev, IBLOCK(ip->inum, fsb.sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->dflags = dip->flags;
+    memmove(ip->data, dip->data, sizeof(ip->data));
+    memset(ip->map, 0, sizeof(ip->map));
+    ip->bnear = 0;
     brelse(bp);
     ip->flags |= I_VALID;
     if(ip->type == 0)
@@ -264,17 +678,32 @@ ilock(struct inode *ip)
   }
 }
 
-// Unlock the given inode.
+// Lock the given inode shared, to read it.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepshared(&ip->lock);
+  if(!(ip->flags & I_VALID)){
+    // Read it in exclusively.  It stays valid
+    // while the caller holds its reference.
+    releasesleep(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleepshared(&ip->lock);
+  }
+}
+
+// Unlock the given inode, however it is locked.
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1)
+  if(ip == 0 || ip->ref < 1)
     panic("iunlock");
 
-  acquire(&icache.lock);
-  ip->flags &= ~I_BUSY;
-  wakeup(ip);
-  release(&icache.lock);
+  releasesleep(&ip->lock);
 }
 
 // Caller holds reference to unlocked ip.  Drop reference.
@@ -282,20 +711,36 @@ void
 iput(struct inode *ip)
 {
   acquire(&icache.lock);
+  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->dn > 0 && ip->nlink > 0){
+    // last reference: allocate the window before ip is recycled.
+    // iflush sleeps on the disk, as may acquiresleep if a namei
+    // finds ip meanwhile, so drop icache.lock; callers of iput
+    // must not hold a spinlock either.
+    release(&icache.lock);
+    acquiresleep(&ip->lock);
+    iflush(ip);
+    releasesleep(&ip->lock);
+    acquire(&icache.lock);
+  }
   if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
     // inode is no longer used: truncate and free inode.
-    if(ip->flags & I_BUSY)
-      panic("iput busy");
-    ip->flags |= I_BUSY;
     release(&icache.lock);
-    itrunc(ip);
+    acquiresleep(&ip->lock);
+    itrunc(ip, 0);
+    if(ip->tags){
+      bfree(ip->dev, ip->tags);
+      ip->tags = 0;
+    }
     ip->type = 0;
     iupdate(ip);
-    acquire(&icache.lock);
+    ifree(ip->inum);
+    dcachepurge(ip->dev, ip->inum);
     ip->flags = 0;
-    wakeup(ip);
+    releasesleep(&ip->lock);
+    acquire(&icache.lock);
   }
-  ip->ref--;
+  if(--ip->ref == 0)
+    ilruinsert(icache.lru.prev, ip);
   release(&icache.lock);
 }
 
@@ -312,75 +757,509 @@ iunlockput(struct inode *ip)
 // The contents (data) associated with each inode is stored
 // in a sequence of blocks on the disk.  The first NDIRECT blocks
 // are listed in ip->addrs[].  The next NINDIRECT blocks are 
-// listed in the block ip->addrs[NDIRECT].
+// listed in the block ip->addrs[NDIRECT], the next NDINDIRECT
+// through the doubly indirect block ip->addrs[NDIRECT+1], and
+// the rest through the triply indirect block ip->addrs[NDIRECT+2].
+// ip->map[] keeps a few entries of the last indirect block that
+// bmap read, so a file read in order finds most of its blocks
+// without walking the indirect blocks again.
+//
+// An inode with DI_EXTENTS instead keeps up to NEXTENT runs of
+// contiguous blocks in ip->addrs[], so a file that balloc laid
+// out in order is mapped without an indirect block.
+//
+// An inode with DI_INLINE has no blocks at all: ip->data[] holds
+// its contents, until ispill moves them to a block.
+
+// A block whose address is 0 is a hole: it reads as zeros and
+// gets a block only when written.  Blocks are zeroed when they
+// are allocated, not when they are freed, so that a free is just
+// a bitmap change in the log.
+
+static uint bmapset(struct inode*, uint, uint, int);
+static uint bmapget(struct inode*, uint);
+
+// Allocate up to *n blocks in a row for ip, right after block
+// near, or if near is 0, after the last block allocated to ip.
+// The first block goes in ip's own group, at one of NCOLOR
+// places picked by inum, so that files grown at the same time
+// do not interleave.  Set *n to the number allocated.
+static uint
+iballocn(struct inode *ip, uint near, uint *n)
+{
+  uint g, b;
+
+  if(near == 0)
+    near = ip->bnear;
+  if(near == 0){
+    g = ip->inum / fsb.sb.ipg;
+    near = GSTART(g, fsb.sb) + ip->inum%NCOLOR * fsb.sb.bpg/NCOLOR;
+  }
+  b = balloc(ip->dev, near, n);
+  ip->bnear = b + *n - 1;
+  return b;
+}
+
+// Allocate a block for ip, as iballocn.
+static uint
+iballoc(struct inode *ip, uint near)
+{
+  uint n;
+
+  n = 1;
+  return iballocn(ip, near, &n);
+}
+
+// Return the disk block address of block bn of extent inode ip.
+// If there is no such block, map it to addr, or to a newly
+// allocated block if addr is 0.  Blocks are only added at the
+// end; a file that needs more runs, or gets a hole, is switched
+// to block addresses.  The switch only logs the i-node and the
+// bitmap blocks: its indirect blocks are all new and unreachable
+// until the i-node is committed, so they are written like file
+// data, which commit writes first, and a big file's conversion
+// still fits in one operation's share of the log.
+static uint
+emap(struct inode *ip, uint bn, uint addr)
+{
+  struct extent *e, old[NEXTENT];
+  uint i, j, off;
+
+  e = (struct extent*)ip->addrs;
+  off = 0;
+  for(i = 0; i < NEXTENT && e[i].len > 0; i++){
+    if(bn < off + e[i].len)
+      return e[i].start + bn - off;
+    off += e[i].len;
+  }
+
+  if(bn == off){
+    // Append, growing the last run if the new block follows it.
+    if(addr == 0)
+      addr = iballoc(ip, i > 0 ? e[i-1].start + e[i-1].len - 1 : 0);
+    if(i > 0 && e[i-1].start + e[i-1].len == addr){
+      e[i-1].len++;
+      return addr;
+    }
+    if(i < NEXTENT){
+      e[i].start = addr;
+      e[i].len = 1;
+      return addr;
+    }
+  }
+
+  memmove(old, e, sizeof(old));
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->dflags &= ~DI_EXTENTS;
+  off = 0;
+  for(i = 0; i < NEXTENT; i++)
+    for(j = 0; j < old[i].len; j++)
+      bmapset(ip, off++, old[i].start + j, 2);
+  return bmapset(ip, bn, addr, 2);
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates a zeroed one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr;
+
+  if((addr = bmapget(ip, bn)) != 0)
+    return addr;
+  if(ip->dflags & DI_EXTENTS)
+    addr = emap(ip, bn, 0);
+  else
+    addr = bmapset(ip, bn, 0, 1);
+  bzero(ip->dev, addr, ip->type == T_DIR);
+  return addr;
+}
+
+// Map unmapped block bn of ip to disk block addr.
+static void
+bmapto(struct inode *ip, uint bn, uint addr)
+{
+  if(ip->dflags & DI_EXTENTS)
+    emap(ip, bn, addr);
+  else
+    bmapset(ip, bn, addr, 1);
+}
+
+// Return the disk block address of the nth block in inode ip,
+// or 0 if it is a hole.  Never allocates.
+static uint
+bmapget(struct inode *ip, uint bn)
+{
+  struct extent *e;
+  uint i;
+
+  if(ip->dflags & DI_EXTENTS){
+    e = (struct extent*)ip->addrs;
+    for(i = 0; i < NEXTENT && e[i].len > 0; i++){
+      if(bn < e[i].len)
+        return e[i].start + bn;
+      bn -= e[i].len;
+    }
+    return 0;
+  }
+  return bmapset(ip, bn, 0, 0);
+}
+
+// Return the disk block address of the nth block in block-mapped
+// inode ip.  If there is no such block and alloc is set, map it
+// to addr, or to a newly allocated block if addr is 0; if alloc
+// is not set, return 0.  If alloc is 2, every indirect block of
+// ip is new, and they are written without the log.
+static uint
+bmapset(struct inode *ip, uint bn, uint addr, int alloc)
+{
+  uint x, *a, i, n, level, fbn;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+    if((x = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = x = addr ? addr : iballoc(ip, bn > 0 ? ip->addrs[bn-1] : 0);
+    return x;
   }
+  acquire(&ip->maplock);
+  x = bn - ip->mapbn < NBMAP ? ip->map[bn - ip->mapbn] : 0;
+  release(&ip->maplock);
+  if(x != 0)
+    return x;
+  fbn = bn;
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
+  // Find the tree holding bn; n is the number of blocks it maps.
+  n = NINDIRECT;
+  for(level = 0; bn >= n; level++){
+    if(level == 2)
+      panic("bmap: out of range");
+    bn -= n;
+    n *= NINDIRECT;
+  }
+
+  // Walk down its indirect blocks, allocating as necessary.
+  if((x = ip->addrs[NDIRECT+level]) == 0){
+    if(!alloc)
+      return 0;
+    ip->addrs[NDIRECT+level] = x = iballoc(ip, 0);
+    bzero(ip->dev, x, alloc == 1);
+  }
+  for(;;){
+    n /= NINDIRECT;
+    bp = bread(ip->dev, x);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      bwrite(bp);
+    i = bn / n;
+    bn %= n;
+    if((x = a[i]) == 0 && alloc){
+      if(n == 1 && addr)
+        x = addr;
+      else
+        x = iballoc(ip, i > 0 ? a[i-1] : 0);
+      if(n > 1)
+        bzero(ip->dev, x, alloc == 1);
+      a[i] = x;
+      if(alloc == 1)
+        log_write(bp);
+      else
+        bwrite(bp);
+    }
+    if(n == 1){
+      // Remember the entries around a[i].
+      acquire(&ip->maplock);
+      ip->mapbn = fbn - i % NBMAP;
+      memmove(ip->map, a + i - i % NBMAP, sizeof(ip->map));
+      release(&ip->maplock);
     }
     brelse(bp);
-    return addr;
+    if(n == 1 || x == 0)
+      return x;
   }
+}
 
-  panic("bmap: out of range");
+// Free the blocks that indirect block bp, level levels above
+// the data, maps at or past its block keep.  If keep is 0, free
+// bp's block too and return 1.
+static int
+ifreeind(struct buf *bp, int level, uint keep)
+{
+  uint j, n, *a, dev, addr;
+  int dirty;
+
+  dev = bp->dev;
+  addr = bp->blockno;
+  a = (uint*)bp->data;
+  for(n = 1, j = 1; j < level; j++)
+    n *= NINDIRECT;
+  dirty = 0;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0 || (j+1)*n <= keep)
+      continue;
+    if(level > 1 && !ifreeind(bread(dev, a[j]), level-1, keep > j*n ? keep - j*n : 0))
+      continue;
+    if(level == 1)
+      bfree(dev, a[j]);
+    a[j] = 0;
+    dirty = 1;
+  }
+  if(keep == 0){
+    brelse(bp);
+    bfree(dev, addr);
+    return 1;
+  }
+  if(dirty)
+    log_write(bp);
+  brelse(bp);
+  return 0;
 }
 
-// Truncate inode (discard contents).
-// Only called after the last dirent referring
-// to this inode has been erased on disk.
+// Delayed allocation.
+//
+// Blocks written past the end of a file are not allocated at
+// once.  They collect, in order, in memory, the file's window:
+// blocks dbn through dbn+dn-1, up to NDWIN of them, packed into
+// pages as dblock[] points.  iflush allocates them all
+// together, so they get a run of blocks with one bitmap update,
+// when the window fills, on the last iput, or on fssync.  A file
+// deleted before then never allocates them at all.  At most
+// NDALLOC files have a window at once; writes to others are
+// allocated as they happen.
+
+// Return where block bn of ip is held in its window, or 0 if
+// the block is not in the window.
+static char*
+iwindow(struct inode *ip, uint bn)
+{
+  if(ip->dn > 0 && bn >= ip->dbn && bn < ip->dbn + ip->dn)
+    return ip->dblock[bn - ip->dbn];
+  return 0;
+}
+
+// Add a zeroed block to the end of ip's window, in a new
+// page if the last one is full.  Returns 0 if out of memory.
+static char*
+iwinadd(struct inode *ip)
+{
+  char *p;
+
+  if(ip->dn % (PGSIZE/BSIZE) == 0){
+    if((p = kalloc()) == 0)
+      return 0;
+  } else
+    p = ip->dblock[ip->dn-1] + BSIZE;
+  memset(p, 0, BSIZE);
+  ip->dblock[ip->dn++] = p;
+  return p;
+}
+
+// Drop the blocks of ip's window from the nth on, freeing
+// the pages no block left uses.
 static void
-itrunc(struct inode *ip)
+iwincut(struct inode *ip, uint n)
 {
-  int i, j;
+  uint i;
+
+  for(i = n; i < ip->dn; i++)
+    if(i % (PGSIZE/BSIZE) == 0)
+      kfree(ip->dblock[i]);
+  ip->dn = n;
+  if(n == 0){
+    acquire(&icache.lock);
+    icache.ndalloc--;
+    release(&icache.lock);
+  }
+}
+
+// Allocate disk blocks for the blocks in ip's window, write
+// them, and free the window.  Caller must hold ip's lock.
+static void
+iflush(struct inode *ip)
+{
+  uint i, k, n, addr, near;
   struct buf *bp;
-  uint *a;
 
-  for(i = 0; i < NDIRECT; i++){
+  if(ip->dn == 0)
+    return;
+  near = ip->dbn > 0 ? bmapget(ip, ip->dbn - 1) : 0;
+  for(i = 0; i < ip->dn; i += n){
+    n = ip->dn - i;
+    addr = iballocn(ip, near, &n);
+    for(k = 0; k < n; k++){
+      bmapto(ip, ip->dbn + i + k, addr + k);
+      bp = boverwrite(ip->dev, addr + k);
+      memmove(bp->data, ip->dblock[i+k], BSIZE);
+      bwrite(bp);
+      brelse(bp);
+    }
+    near = addr + n - 1;
+  }
+  iupdate(ip);
+  iwincut(ip, 0);
+}
+
+// Return where to write block bn of ip if its allocation can be
+// delayed, or 0 if it must be allocated now.  It can be if bn is
+// in ip's window, or past the end of the file; the window only
+// grows by appending, so other blocks first flush it.
+// Caller must hold ip's lock.
+static char*
+idelay(struct inode *ip, uint bn)
+{
+  char *p;
+
+  if(NDALLOC == 0 || ip->type != T_FILE)
+    return 0;
+  if((p = iwindow(ip, bn)) != 0)
+    return p;
+  if(ip->dn > 0 && bn == ip->dbn + ip->dn && ip->dn < NDWIN &&
+     (p = iwinadd(ip)) != 0)
+    return p;
+  iflush(ip);
+  if(bn < (ip->size + BSIZE-1)/BSIZE)
+    return 0;
+
+  acquire(&icache.lock);
+  if(icache.ndalloc >= NDALLOC){
+    release(&icache.lock);
+    return 0;
+  }
+  icache.ndalloc++;
+  release(&icache.lock);
+  ip->dbn = bn;
+  if((p = iwinadd(ip)) == 0){
+    acquire(&icache.lock);
+    icache.ndalloc--;
+    release(&icache.lock);
+  }
+  return p;
+}
+
+// Flush the windows of all files, as of when it is called:
+// windows started while it runs may be left.
+static void
+iflushall(void)
+{
+  struct inode *ip;
+  uint gen;
+  int h;
+
+  acquire(&icache.lock);
+  gen = ++icache.dgen;
+again:
+  for(h = 0; h < NIHASH; h++){
+    for(ip = icache.hash[h]; ip; ip = ip->hnext){
+      if(ip->ref > 0 && ip->dn > 0 && ip->dgen != gen){
+        ip->dgen = gen;
+        ip->ref++;
+        release(&icache.lock);
+        begin_op();
+        ilock(ip);
+        iflush(ip);
+        iunlockput(ip);
+        end_op();
+        acquire(&icache.lock);
+        goto again;
+      }
+    }
+  }
+  release(&icache.lock);
+}
+
+// Move the contents of inline inode ip to a block, so that it
+// can grow past NINLINE.  Caller must hold ip's lock.
+static void
+ispill(struct inode *ip)
+{
+  char data[NINLINE];
+
+  memmove(data, ip->data, NINLINE);
+  memset(ip->data, 0, sizeof(ip->data));
+  ip->dflags = EXTENTS ? DI_EXTENTS : 0;
+  if(writei(ip, data, 0, ip->size) != ip->size)
+    panic("ispill");
+  iupdate(ip);
+}
+
+// Set the size of ip to size bytes.  Shrinking frees the
+// blocks past the new end; growing leaves a hole.
+// Caller must hold ip's lock.
+void
+itrunc(struct inode *ip, uint size)
+{
+  uint i, j, nb, off, keep, start, n;
+  struct buf *bp[3];
+  struct extent *e;
+  uint addr;
+
+  char *p;
+
+  pagedrop(ip, size);
+  if(ip->dflags & DI_INLINE){
+    if(size <= NINLINE){
+      if(size < ip->size)
+        memset(ip->data + size, 0, NINLINE - size);
+      goto out;
+    }
+    ispill(ip);
+  }
+  if(size >= ip->size)
+    goto out;
+
+  // Zero the rest of the new last block, in case the file
+  // grows over it again.
+  if(size % BSIZE && (p = iwindow(ip, size/BSIZE)) != 0)
+    memset(p + size%BSIZE, 0, BSIZE - size%BSIZE);
+  else if(size % BSIZE && (addr = bmapget(ip, size/BSIZE)) != 0){
+    bp[0] = bread(ip->dev, addr);
+    memset(bp[0]->data + size%BSIZE, 0, BSIZE - size%BSIZE);
+    bwrite(bp[0]);
+    brelse(bp[0]);
+  }
+
+  // Drop the window's blocks past the end unallocated.
+  nb = (size + BSIZE-1) / BSIZE;
+  if(ip->dn > 0 && nb < ip->dbn + ip->dn)
+    iwincut(ip, nb > ip->dbn ? nb - ip->dbn : 0);
+
+  memset(ip->map, 0, sizeof(ip->map));
+  if(ip->dflags & DI_EXTENTS){
+    e = (struct extent*)ip->addrs;
+    for(i = 0, off = 0; i < NEXTENT; i++){
+      keep = nb > off ? min(nb - off, e[i].len) : 0;
+      for(j = keep; j < e[i].len; j++)
+        bfree(ip->dev, e[i].start + j);
+      off += e[i].len;
+      e[i].len = keep;
+      if(keep == 0)
+        e[i].start = 0;
+    }
+    goto out;
+  }
+
+  // Read the indirect blocks while freeing the direct ones.
+  for(i = 0, start = NDIRECT, n = NINDIRECT; i < 3; i++, start += n, n *= NINDIRECT){
+    bp[i] = 0;
+    if(ip->addrs[NDIRECT+i] && nb < start + n)
+      bp[i] = bread_async(ip->dev, ip->addrs[NDIRECT+i]);
+  }
+
+  for(i = nb; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
       ip->addrs[i] = 0;
     }
   }
-  
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+
+  for(i = 0, start = NDIRECT, n = NINDIRECT; i < 3; i++, start += n, n *= NINDIRECT){
+    if(bp[i]){
+      bwait(bp[i]);
+      if(ifreeind(bp[i], i+1, nb > start ? nb - start : 0))
+        ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
-  
-  if (ip->tags) {
-    bfree(ip->dev, ip->tags);
-    ip->tags = 0;
   }
 
-  ip->size = 0;
+out:
+  ip->size = size;
   iupdate(ip);
 }
 
@@ -399,8 +1278,9 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, i, nb, addr;
+  char *p;
+  struct buf *bp[NRBATCH];
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -413,21 +1293,59 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+  if(ip->dflags & DI_INLINE){
+    memmove(dst, ip->data + off, n);
+    return n;
+  }
+
+  for(tot=0; tot<n; ){
+    // Queue reads of the next few blocks, then copy each out
+    // as it arrives.
+    nb = min((off%BSIZE + n-tot + BSIZE-1) / BSIZE, NRBATCH);
+    for(i = 0; i < nb; i++){
+      bp[i] = 0;
+      if(iwindow(ip, off/BSIZE + i) == 0 && (addr = bmapget(ip, off/BSIZE + i)) != 0)
+        bp[i] = bread_async(ip->dev, addr);
+    }
+    for(i = 0; i < nb; i++, tot+=m, off+=m, dst+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(bp[i] == 0){
+        if((p = iwindow(ip, off/BSIZE)) != 0)
+          memmove(dst, p + off%BSIZE, m);
+        else
+          memset(dst, 0, m);  // hole
+        continue;
+      }
+      bwait(bp[i]);
+      memmove(dst, bp[i]->data + off%BSIZE, m);
+      brelse(bp[i]);
+    }
   }
   return n;
 }
 
+// Start reading blocks bn through bn+n-1 of ip into the
+// buffer cache, without waiting for them.
+// Caller must hold ip's lock.
+void
+ireadahead(struct inode *ip, uint bn, uint n)
+{
+  uint addr;
+
+  if(ip->type == T_DEV || (ip->dflags & DI_INLINE))
+    return;
+  for(; n > 0 && bn < MAXFILE && bn*BSIZE < ip->size; bn++, n--)
+    if((addr = bmapget(ip, bn)) != 0)
+      breada(ip->dev, addr);
+}
+
 // Write data to inode.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *p;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
@@ -435,16 +1353,40 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return devsw[ip->major].write(ip, src, n);
   }
 
-  if(off > ip->size || off + n < off)
+  if(off > MAXFILE*BSIZE || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     n = MAXFILE*BSIZE - off;
 
+  pagewrite(ip, src, off, n);
+  if(ip->dflags & DI_INLINE){
+    if(off + n <= NINLINE){
+      memmove(ip->data + off, src, n);
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    ispill(ip);
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((p = idelay(ip, off/BSIZE)) != 0){
+      memmove(p + off%BSIZE, src, m);
+      continue;
+    }
+    // A new block is zeroed in the cache by bmap, and one
+    // written whole need not be read.
+    if(m == BSIZE)
+      bp = boverwrite(ip->dev, bmap(ip, off/BSIZE));
+    else
+      bp = bread(ip->dev, bmap(ip, off/BSIZE));
     memmove(bp->data + off%BSIZE, src, m);
-    bwrite(bp);
+    if(ip->type == T_DIR)
+      log_write(bp);
+    else
+      bwrite(bp);  // file data is not logged
     brelse(bp);
   }
 
@@ -463,6 +1405,175 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name lookup cache.
+//
+// Remembers what looking up a name in a directory found:
+// an inode number, or 0 if the name is not there.  namex
+// consults it before reading any directory blocks.  Entries
+// are filled in and changed only while the directory is
+// locked, by namex, dirlink and dcacheset, so a locked
+// directory's entries agree with its contents.
+// The table is direct mapped: a new entry replaces
+// whatever hashed to the same slot.  What it saves shows in
+// the buffer cache counts ^P prints: compare them after the
+// same workload with NDENTRY set to 1, where nearly every
+// lookup reads the directory.
+
+struct dentry {
+  uint dev;
+  uint dir;   // directory inum; 0 if slot is unused
+  uint inum;  // what name maps to; 0 if absent
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDENTRY];
+} dcache;
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry*
+dslot(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return &dcache.ent[h % NDENTRY];
+}
+
+// Look up name in directory dp in the cache.
+// If present, set *inum and return 1.
+// Caller must hold dp's lock.
+static int
+dcacheget(struct inode *dp, char *name, uint *inum)
+{
+  struct dentry *d;
+  int found;
+
+  acquire(&dcache.lock);
+  d = dslot(dp->dev, dp->inum, name);
+  found = d->dir == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0;
+  if(found)
+    *inum = d->inum;
+  release(&dcache.lock);
+  return found;
+}
+
+// Record that name in directory dp now maps to inum,
+// or is absent if inum is 0.
+// Caller must hold dp's lock.
+void
+dcacheset(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dslot(dp->dev, dp->inum, name);
+  d->dev = dp->dev;
+  d->dir = dp->inum;
+  d->inum = inum;
+  strncpy(d->name, name, DIRSIZ);
+  release(&dcache.lock);
+}
+
+// Forget every entry in or for inode inum, which is
+// being freed and may come back as something else.
+static void
+dcachepurge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < dcache.ent+NDENTRY; d++)
+    if(d->dev == dev && (d->dir == inum || d->inum == inum))
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
+// Hash of a directory entry name.  (FNV-1a;
+// tools/mkfs.c has a copy that must agree.)
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Bucket for hash h in a hashed directory with nb buckets.
+static uint
+dirbucket(uint h, uint nb)
+{
+  uint m;
+
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  if(h % m < nb - m)
+    return h % (2*m);
+  return h % m;
+}
+
+// Block of hashed directory dp that holds name.
+static uint
+dirblock(struct inode *dp, char *name)
+{
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return 0;
+  return dirbucket(dirhash(name), dp->major);
+}
+
+// Look for name in the n bytes of directory entries at data,
+// which are at offset off in the directory.  Returns the inum,
+// setting *poff to the entry's offset, or 0 if it is not there.
+static uint
+dirmatch(char *data, uint n, uint off, char *name, uint *poff)
+{
+  struct dirent *de;
+
+  for(de = (struct dirent*)data; de < (struct dirent*)(data + n); de++){
+    if(de->inum == 0)
+      continue;
+    if(namecmp(name, de->name) == 0){
+      // entry matches path element
+      if(poff)
+        *poff = off + (char*)de - data;
+      return de->inum;
+    }
+  }
+  return 0;
+}
+
+// Look for name in block bn of directory dp.
+static struct inode*
+dirscan(struct inode *dp, uint bn, char *name, uint *poff)
+{
+  uint inum, addr;
+  struct buf *bp;
+
+  if((addr = bmapget(dp, bn)) == 0)
+    return 0;  // hole: no entries
+  bp = bread(dp->dev, addr);
+  inum = dirmatch((char*)bp->data, BSIZE, bn*BSIZE, name, poff);
+  brelse(bp);
+  if(inum == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 // Caller must have already locked dp.
@@ -470,40 +1581,130 @@ struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct buf *bp;
-  struct dirent *de;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += BSIZE){
-    bp = bread(dp->dev, bmap(dp, off / BSIZE));
-    for(de = (struct dirent*)bp->data;
-        de < (struct dirent*)(bp->data + BSIZE);
-        de++){
-      if(de->inum == 0)
-        continue;
-      if(namecmp(name, de->name) == 0){
-        // entry matches path element
-        if(poff)
-          *poff = off + (uchar*)de - bp->data;
-        inum = de->inum;
-        brelse(bp);
-        return iget(dp->dev, inum);
-      }
-    }
-    brelse(bp);
+  if(dp->major > 0)
+    return dirscan(dp, dirblock(dp, name), name, poff);
+
+  if(dp->dflags & DI_INLINE){
+    if((inum = dirmatch(dp->data, dp->size, 0, name, poff)) == 0)
+      return 0;
+    return iget(dp->dev, inum);
+  }
+
+  // Start reading the whole directory rather than one
+  // block per interrupt.
+  ireadahead(dp, 0, min((dp->size + BSIZE-1)/BSIZE, NREADAHEAD));
+
+  for(off = 0; off < dp->size; off += BSIZE)
+    if((ip = dirscan(dp, off/BSIZE, name, poff)) != 0)
+      return ip;
+  return 0;
+}
+
+// Add a bucket to hashed directory dp, moving the entries
+// of the bucket it splits that now hash to the new one.
+// Returns -1 if dp already has all the buckets it can.
+static int
+dirsplit(struct inode *dp)
+{
+  uint nb, m, s;
+  struct buf *bp, *nbp;
+  struct dirent *de, *nde;
+
+  nb = dp->major;
+  if(nb >= NDIRBUCKET || nb >= MAXFILE)
+    return -1;
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  s = nb - m;
+
+  bp = bread(dp->dev, bmap(dp, s));
+  nbp = bread(dp->dev, bmap(dp, nb));
+  memset(nbp->data, 0, BSIZE);
+  nde = (struct dirent*)nbp->data;
+  de = (struct dirent*)bp->data;
+  if(s == 0)
+    de += 2;  // . and ..
+  for(; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(de->inum == 0 || dirbucket(dirhash(de->name), nb+1) == s)
+      continue;
+    *nde++ = *de;
+    memset(de, 0, sizeof(*de));
+  }
+  log_write(nbp);
+  brelse(nbp);
+  log_write(bp);
+  brelse(bp);
+
+  dp->major = nb + 1;
+  dp->size = (nb + 1) * BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Does directory dp have no free entry where dirlink would put
+// name?  Only a hashed directory, or a one-block linear one,
+// which dirlink turns into a hashed one, can be full.
+static int
+dirfull(struct inode *dp, char *name)
+{
+  uint addr;
+  struct buf *bp;
+  struct dirent *de;
+  int full;
+
+  if(dp->major == 0 && (dp->size != BSIZE || (dp->dflags & DI_INLINE)))
+    return 0;
+  if((addr = bmapget(dp, dp->major == 0 ? 0 : dirblock(dp, name))) == 0)
+    return 0;  // hole: all free
+  bp = bread(dp->dev, addr);
+  full = 1;
+  for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++)
+    if(de->inum == 0)
+      full = 0;
+  brelse(bp);
+  return full;
+}
+
+// Make sure directory dp has room for name, splitting buckets
+// as often as it takes.  Linear hashing splits buckets in
+// order, so that may be many; each split is an operation of its
+// own, to stay within MAXOPBLOCKS.  Caller must hold dp's lock,
+// in an operation that has changed nothing yet; between splits
+// dp is unlocked and the operation ended and begun again.
+// Returns -1 if dp cannot grow, or went away meanwhile.
+int
+dirroom(struct inode *dp, char *name)
+{
+  while(dirfull(dp, name)){
+    if(dp->major == 0){
+      dp->major = 1;
+      iupdate(dp);
+    } else if(dirsplit(dp) < 0)
+      return -1;
+    iunlock(dp);
+    end_op();
+    begin_op();
+    ilock(dp);
+    if(dp->nlink == 0)
+      return -1;
   }
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is present, or if dp has no room for it.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  int off, split;
+  struct dirent de, *dep;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -511,20 +1712,54 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dp->major == 0){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+
+    // A linear directory about to outgrow one block becomes
+    // hashed, with that block as its only bucket.  Larger
+    // linear directories, made before hashing, stay linear.
+    if(off != BSIZE || dp->size != BSIZE){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink");
+      dcacheset(dp, name, inum);
+      return 0;
+    }
+    dp->major = 1;
+    iupdate(dp);
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
-  
-  return 0;
+  // Put the entry in its bucket, splitting a bucket if it is
+  // full.  Linear hashing may split some other bucket, but one
+  // split is all the log space of an operation allows: if the
+  // bucket is still full, fail.  Callers use dirroom first,
+  // which splits as often as it takes.
+  for(split = 0;; split = 1){
+    bp = bread(dp->dev, bmap(dp, dirblock(dp, name)));
+    dep = (struct dirent*)bp->data;
+    if(dirblock(dp, name) == 0)
+      dep += 2;  // . and ..
+    for(; dep < (struct dirent*)(bp->data + BSIZE); dep++){
+      if(dep->inum == 0){
+        strncpy(dep->name, name, DIRSIZ);
+        dep->inum = inum;
+        log_write(bp);
+        brelse(bp);
+        dcacheset(dp, name, inum);
+        return 0;
+      }
+    }
+    brelse(bp);
+    if(split || dirsplit(dp) < 0)
+      return -1;
+  }
 }
 
 // Paths
@@ -573,6 +1808,7 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  uint inum;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
@@ -580,7 +1816,7 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(proc->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
       return 0;
@@ -590,7 +1826,13 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
+    if(dcacheget(ip, name, &inum))
+      next = inum ? iget(ip->dev, inum) : 0;
+    else {
+      next = dirlookup(ip, name, 0);
+      dcacheset(ip, name, next ? next->inum : 0);
+    }
+    if(next == 0){
       iunlockput(ip);
       return 0;
     }
@@ -617,6 +1859,17 @@ nameiparent(char *path, char *name)
   return namex(path, 1, name);
 }
 
+// Return ip's tag block, allocating a zeroed one if it has none.
+static uint
+itags(struct inode *ip)
+{
+  if(!ip->tags){
+    ip->tags = iballoc(ip, 0);
+    bzero(ip->dev, ip->tags, 0);
+  }
+  return ip->tags;
+}
+
 int
 tagFile(int fileDescriptor, char* key, char* value, int valueLength)
 {
@@ -629,8 +1882,7 @@ tagFile(int fileDescriptor, char* key, char* value, int valueLength)
   if (!key || (keyLength = strlen(key)) < 1 || keyLength > 9) return -1;
   if (!value || valueLength < 0 || valueLength > 18) return -1;
   ilock(f->ip);
-  if (!f->ip->tags) f->ip->tags = balloc(f->ip->dev);
-  bp = bread(f->ip->dev, f->ip->tags);
+  bp = bread(f->ip->dev, itags(f->ip));
   str = (uchar*)bp->data;
   int keyPos = searchKey((uchar*)key, (uchar*)str);
   if (keyPos < 0) {
@@ -695,7 +1947,7 @@ getFileTag(int fileDescriptor, char* key, char* buffer, int length)
   int keyLength;
   int valueLength;
   struct buf *bp;
-  uchar str[BSIZE];
+  uchar str[TAGSIZE];
   uchar *value;
   if (fileDescriptor < 0 || fileDescriptor >= NOFILE || (f = proc->ofile[fileDescriptor]) == 0) return -1;
   if (f->type != FD_INODE || !f->readable || !f->ip) return -1;
@@ -703,9 +1955,8 @@ getFileTag(int fileDescriptor, char* key, char* buffer, int length)
   if (!buffer) return -1;
   if (length < 0 || length > 18) return -1;
   ilock(f->ip);
-  if (!f->ip->tags) f->ip->tags = balloc(f->ip->dev);
-  bp = bread(f->ip->dev, f->ip->tags);
-  memmove((void*)str, (void*)bp->data, (uint)BSIZE);
+  bp = bread(f->ip->dev, itags(f->ip));
+  memmove((void*)str, (void*)bp->data, (uint)TAGSIZE);
   brelse(bp);
   iunlock(f->ip);
   // for (int i = 0; i < BSIZE; i += 32) {
@@ -731,7 +1982,7 @@ getAllTags(int fileDescriptor, struct Key *keys, int maxTags)
 {
   struct file *f;
   struct buf *bp;
-  uchar str[BSIZE];
+  uchar str[TAGSIZE];
   uint i = 0;
   int j = 0;
   if (fileDescriptor < 0 || fileDescriptor >= NOFILE || (f = proc->ofile[fileDescriptor]) == 0) return -1;
@@ -742,17 +1993,16 @@ getAllTags(int fileDescriptor, struct Key *keys, int maxTags)
   if (maxTags < 0) return -1;
   // cprintf("getAllTags\n");
   ilock(f->ip);
-  if (!f->ip->tags) f->ip->tags = balloc(f->ip->dev);
-  bp = bread(f->ip->dev, f->ip->tags);
-  memmove((void*)str, (void*)bp->data, (uint)BSIZE);
+  bp = bread(f->ip->dev, itags(f->ip));
+  memmove((void*)str, (void*)bp->data, (uint)TAGSIZE);
   brelse(bp);
   iunlock(f->ip);
   // for (i = 0; i < BSIZE; i += 32) {
   //   cprintf("getAllTags: key = %s\t value = %s\n", str + i, str + i + 10);
   // }
   cprintf("\n");
-  for (i = 0, j = 0; i < BSIZE; i += 32) {
-    if (str[i]) {
+  for (i = 0, j = 0; i < TAGSIZE; i += 32) {
+    if (str[i] && j < maxTags) {
       memmove((void*)keys[j].key, (void*)((uint)str + i), (uint)strlen((char*)((uint)str + (uint)i)));
       j++;
     }
@@ -822,7 +2072,7 @@ readBuf(struct file* f, char* key, char* value, int valueLength, char* results,
   int j = 0;
   int k = 0;
   struct buf *bp;
-  uchar str[BSIZE];
+  uchar str[TAGSIZE];
   int keyPos = 0;
   int valueLengthActual = 0;
   char *valueActual;
@@ -835,7 +2085,7 @@ readBuf(struct file* f, char* key, char* value, int valueLength, char* results,
   // if (!f->ip->tags) f->ip->tags = balloc(f->ip->dev);
   if (!f->ip->tags) return 0;
   bp = bread(f->ip->dev, f->ip->tags);
-  memmove((void*)str, (void*)bp->data, (uint)BSIZE);
+  memmove((void*)str, (void*)bp->data, (uint)TAGSIZE);
   brelse(bp);
   // iunlock(f->ip);
   // f->ip->ref = 0;
@@ -1,4 +1,9 @@
 // Simple PIO-based (non-DMA) IDE driver code.
+//
+// A file system block is BSIZE/SECTSIZE sectors.  With more than
+// one, the driver moves a whole block per command and interrupt,
+// using the READ/WRITE MULTIPLE commands, after ideinit has set
+// each disk's multiple count to the sectors in a block.
 
 #include "types.h"
 #include "defs.h"
@@ -9,6 +14,10 @@
 #include "traps.h"
 #include "spinlock.h"
 #include "buf.h"
+#include "fs.h"
+
+#define SECTSIZE      512
+#define SPB           (BSIZE/SECTSIZE)  // sectors per block
 
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
@@ -17,6 +26,9 @@
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_RDMUL 0xc4
+#define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
@@ -41,6 +53,18 @@ idewait(int checkerr)
   return 0;
 }
 
+// Have disk dev move SPB sectors per READ/WRITE MULTIPLE.
+static void
+ideset(int dev)
+{
+  outb(0x1f6, 0xe0 | ((dev&1)<<4));
+  outb(0x1f2, SPB);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  if(idewait(1) < 0)
+    panic("ideset: no multiple mode");
+  outb(0x1f6, 0xe0 | (0<<4));
+}
+
 void
 ideinit(void)
 {
@@ -62,27 +86,36 @@ ideinit(void)
   
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  if(SPB > 1){
+    ideset(0);
+    if(havedisk1)
+      ideset(1);
+  }
 }
 
 // Start the request for b.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  uint sector;
+
   if(b == 0)
     panic("idestart");
+  sector = b->blockno * SPB;
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, 1);  // number of sectors
-  outb(0x1f3, b->sector & 0xff);
-  outb(0x1f4, (b->sector >> 8) & 0xff);
-  outb(0x1f5, (b->sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((b->sector>>24)&0x0f));
+  outb(0x1f2, SPB);  // number of sectors
+  outb(0x1f3, sector & 0xff);
+  outb(0x1f4, (sector >> 8) & 0xff);
+  outb(0x1f5, (sector >> 16) & 0xff);
+  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
-    outb(0x1f7, IDE_CMD_WRITE);
-    outsl(0x1f0, b->data, 512/4);
+    outb(0x1f7, SPB == 1 ? IDE_CMD_WRITE : IDE_CMD_WRMUL);
+    outsl(0x1f0, b->data, BSIZE/4);
   } else {
-    outb(0x1f7, IDE_CMD_READ);
+    outb(0x1f7, SPB == 1 ? IDE_CMD_READ : IDE_CMD_RDMUL);
   }
 }
 
@@ -90,7 +123,7 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *done;
 
   // Take first buffer off queue.
   acquire(&idelock);
@@ -103,34 +136,45 @@ ideintr(void)
 
   // Read data if needed.
   if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, 512/4);
+    insl(0x1f0, b->data, BSIZE/4);
   
   // Wake process waiting for this buf.
   b->flags |= B_VALID;
   b->flags &= ~B_DIRTY;
   wakeup(b);
+
+  // No one waits for an asynchronous read.
+  done = 0;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    done = b;
+  }
   
   // Start disk on next buf in queue.
   if(idequeue != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  if(done)
+    brelse(done);
 }
 
-// Sync buf with disk. 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Queue a request to sync buf with disk, as iderw does,
+// and return without waiting for it.  The caller must call
+// ideawait before using buf again, unless buf is B_ASYNC:
+// then ideintr releases buf with brelse when it is done.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
   struct buf **pp;
 
   if(!(b->flags & B_BUSY))
-    panic("iderw: buf not busy");
+    panic("idesubmit: buf not busy");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    panic("idesubmit: ide disk 1 not present");
 
   acquire(&idelock);
 
@@ -143,12 +187,28 @@ iderw(struct buf *b)
   // Start disk if necessary.
   if(idequeue == b)
     idestart(b);
-  
-  // Wait for request to finish.
+
+  release(&idelock);
+}
+
+// Wait for the request for buf queued by idesubmit to finish.
+void
+ideawait(struct buf *b)
+{
+  acquire(&idelock);
   // Assuming will not sleep too long: ignore proc->killed.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
   release(&idelock);
 }
+
+// Sync buf with disk. 
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  ideawait(b);
+}
@@ -0,0 +1,390 @@
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+
+// Write-ahead log of file system metadata, with group commit.
+//
+// A system call that changes the file system brackets its
+// changes with begin_op() and end_op(), and writes each metadata
+// block it changes with log_write() instead of bwrite():
+//
+//   begin_op();
+//   bp = bread(...);
+//   bp->data[...] = ...;
+//   log_write(bp);
+//   brelse(bp);
+//   ...
+//   end_op();
+//
+// log_write() only adds the block to the header in memory and
+// marks the buffer B_DIRTY|B_LOGGED, which keeps it in the cache
+// and keeps bflush() from writing it home.  A block changed again
+// before the next commit takes no more room in the log.
+//
+// A commit writes the blocks logged since the last one to the
+// log in one batch, then the header, which makes them count:
+// at boot, initlog() copies every block in the header to its
+// home.  Commits wait until no operation is in progress, so they
+// hold whole operations, from however many processes ran them.
+// One happens on logsync(), which fssync() calls, or when the log
+// may not have room for another operation.
+//
+// File data is not logged.  A commit writes back dirty data
+// first, so committed metadata does not point at blocks whose
+// contents never reached the disk.
+//
+// Committed blocks are written home lazily, by bflush() like any
+// dirty buffer, and stay in the log until it fills up.  Then a
+// checkpoint writes home what is left and empties the log.
+//
+// The on-disk format:
+//   header block, containing block #s for block A, B, C, ...
+//   block A
+//   block B
+//   block C
+//   ...
+
+// Contents of the header block, used for both the on-disk header
+// block and to keep track in memory of logged block# before commit.
+struct logheader {
+  int n;
+  int block[LOGSIZE];
+};
+
+struct {
+  struct spinlock lock;
+  int start;
+  int size;        // log blocks, not counting the header
+  int outstanding; // how many FS sys calls are executing
+  int committing;  // in commit(), please wait
+  int dev;
+  int ncommit;     // lh.block[0..ncommit-1] are committed
+  uint ncommits;   // commits since boot; see logcommits
+  struct logheader lh;
+
+  // Blocks freed since they were logged; see logrevoke.
+  int nrevoke;
+  uint revoke[LOGSIZE];
+
+  // Requests that write cached blocks to the log, and
+  // read and write the header, through hdata.
+  struct buf io[LOGSIZE+1];
+  uchar hdata[BSIZE];
+} log;
+
+static void recover_from_log(void);
+
+void
+initlog(int dev, struct superblock *sb)
+{
+  if(sizeof(struct logheader) >= BSIZE)
+    panic("initlog: too big logheader");
+
+  initlock(&log.lock, "log");
+  log.start = sb->logstart;
+  log.size = sb->nlog - 1;
+  if(log.size > LOGSIZE)
+    log.size = LOGSIZE;
+  if(log.size < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.dev = dev;
+  recover_from_log();
+}
+
+// Read or write log block i, or the header if i is -1,
+// from or to data, without going through the buffer cache.
+// Returns the request, for ideawait.
+static struct buf*
+logio(int i, uchar *data, int write)
+{
+  struct buf *b;
+
+  b = &log.io[i < 0 ? LOGSIZE : i];
+  b->dev = log.dev;
+  b->blockno = log.start + 1 + i;
+  b->data = data;
+  b->flags = B_BUSY | (write ? B_DIRTY : 0);
+  idesubmit(b);
+  return b;
+}
+
+// Read the log header from disk into the in-memory log header.
+static void
+read_head(void)
+{
+  struct logheader *lh;
+  int i;
+
+  ideawait(logio(-1, log.hdata, 0));
+  lh = (struct logheader*)log.hdata;
+  log.lh.n = lh->n;
+  for(i = 0; i < log.lh.n; i++)
+    log.lh.block[i] = lh->block[i];
+}
+
+// Write the in-memory log header to disk.  This is the point
+// at which the blocks it lists are committed or, if it lists
+// none, at which the log is emptied.
+static void
+write_head(void)
+{
+  struct logheader *lh;
+  int i;
+
+  lh = (struct logheader*)log.hdata;
+  lh->n = log.lh.n;
+  for(i = 0; i < log.lh.n; i++)
+    lh->block[i] = log.lh.block[i];
+  ideawait(logio(-1, log.hdata, 1));
+}
+
+// Copy committed blocks from log to their home location,
+// in log order, so a block logged twice ends up as last logged.
+static void
+recover_from_log(void)
+{
+  struct buf *bp;
+  int i;
+
+  read_head();
+  for(i = 0; i < log.lh.n; i++){
+    bp = boverwrite(log.dev, log.lh.block[i]);
+    ideawait(logio(i, bp->data, 0));
+    bwrite(bp);
+    brelse(bp);
+  }
+  bflush();
+  if(log.lh.n > 0){
+    log.lh.n = 0;
+    write_head();
+  }
+}
+
+// Write home every block in the log that bflush has not, then
+// empty the log.  Caller must have set log.committing, with
+// everything in the log committed.
+static void
+checkpoint(void)
+{
+  struct buf *b, *bp[LOGSIZE];
+  int i, j, n;
+
+  n = 0;
+  for(i = 0; i < log.lh.n; i++){
+    // A block logged twice need only be written once.
+    for(j = i+1; j < log.lh.n; j++)
+      if(log.lh.block[j] == log.lh.block[i])
+        break;
+    if(j < log.lh.n)
+      continue;
+    // Not cached: written home, then recycled.
+    if((b = bpeek(log.dev, log.lh.block[i])) == 0)
+      continue;
+    if(b->flags & B_DIRTY){
+      idesubmit(b);
+      bp[n++] = b;
+    } else
+      brelse(b);
+  }
+  for(i = 0; i < n; i++){
+    ideawait(bp[i]);
+    brelse(bp[i]);
+  }
+
+  log.lh.n = 0;
+  log.ncommit = 0;
+  write_head();
+  acquire(&log.lock);
+  log.nrevoke = 0;
+  release(&log.lock);
+}
+
+// Write the blocks logged since the last commit to the log,
+// then the header.  Checkpoint if the log is then too full for
+// another operation.  Caller must have set log.committing,
+// with no operations outstanding.
+static void
+commit(void)
+{
+  struct buf *bp[LOGSIZE];
+  int i;
+
+  if(log.lh.n > log.ncommit){
+    bflush();  // file data first
+    for(i = log.ncommit; i < log.lh.n; i++){
+      if((bp[i] = bpeek(log.dev, log.lh.block[i])) == 0)
+        panic("commit: logged block not cached");
+      logio(i, bp[i]->data, 1);
+    }
+    for(i = log.ncommit; i < log.lh.n; i++)
+      ideawait(&log.io[i]);
+    write_head();
+
+    // Now bflush may write them home.
+    for(i = log.ncommit; i < log.lh.n; i++){
+      bp[i]->flags &= ~B_LOGGED;
+      brelse(bp[i]);
+    }
+    log.ncommit = log.lh.n;
+    acquire(&log.lock);
+    log.ncommits++;
+    release(&log.lock);
+  }
+  if(log.lh.n + MAXOPBLOCKS > log.size)
+    checkpoint();
+}
+
+// Called at the start of each FS system call.
+void
+begin_op(void)
+{
+  acquire(&log.lock);
+  while(1){
+    if(log.committing){
+      sleep(&log, &log.lock);
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size){
+      // this op might exhaust log space; wait for commit.
+      sleep(&log, &log.lock);
+    } else {
+      log.outstanding += 1;
+      release(&log.lock);
+      break;
+    }
+  }
+}
+
+// Called at the end of each FS system call.
+// Commits if this was the last outstanding operation
+// and the log may not have room for another.
+void
+end_op(void)
+{
+  int do_commit = 0;
+
+  acquire(&log.lock);
+  log.outstanding -= 1;
+  if(log.outstanding == 0 && !log.committing &&
+     log.lh.n + MAXOPBLOCKS > log.size){
+    do_commit = 1;
+    log.committing = 1;
+  }
+  // begin_op() may be waiting for log space,
+  // or logsync() for this operation to finish.
+  wakeup(&log);
+  release(&log.lock);
+
+  if(do_commit){
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    commit();
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+  }
+}
+
+// Commit every operation that has finished, waiting for the
+// ones in progress; operations that begin meanwhile wait.
+// Must not be called inside an operation.
+void
+logsync(void)
+{
+  acquire(&log.lock);
+  while(log.committing)
+    sleep(&log, &log.lock);
+  log.committing = 1;
+  while(log.outstanding > 0)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  commit();
+
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Caller has modified b->data and is done with the buffer.
+// Record the block number and pin it in the cache with B_LOGGED.
+// commit() will write it to the log.
+//
+// log_write() replaces bwrite(); a typical use is:
+//   bp = bread(...)
+//   modify bp->data[]
+//   log_write(bp)
+//   brelse(bp)
+void
+log_write(struct buf *b)
+{
+  if((b->flags & B_BUSY) == 0)
+    panic("log_write");
+
+  acquire(&log.lock);
+  if(log.outstanding < 1)
+    panic("log_write outside of trans");
+  // A B_LOGGED block is in the log since the last commit:
+  // absorb this write into that one.
+  if(!(b->flags & B_LOGGED)){
+    if(log.lh.n >= log.size)
+      panic("too big a transaction");
+    log.lh.block[log.lh.n++] = b->blockno;
+  }
+  b->flags |= B_DIRTY | B_LOGGED;
+  release(&log.lock);
+}
+
+// Block b is being freed.  It may be reused for file data, which
+// is not logged, but if b is in the log, recovery would copy its
+// logged contents over that data.  So remember b until the next
+// checkpoint; balloc must not reuse it before then.
+// Call with b's bitmap block held, before marking b free.
+void
+logrevoke(uint b)
+{
+  int i;
+
+  acquire(&log.lock);
+  for(i = 0; i < log.lh.n; i++){
+    if(log.lh.block[i] == b){
+      // Each revoked block is a different block in the log.
+      if(log.nrevoke >= LOGSIZE)
+        panic("logrevoke");
+      log.revoke[log.nrevoke++] = b;
+      break;
+    }
+  }
+  release(&log.lock);
+}
+
+// Copy the blocks that must not be reused yet into list,
+// which has room for LOGSIZE, and return how many there are.
+int
+logrevoked(uint *list)
+{
+  int i, n;
+
+  acquire(&log.lock);
+  n = log.nrevoke;
+  for(i = 0; i < n; i++)
+    list[i] = log.revoke[i];
+  release(&log.lock);
+  return n;
+}
+
+// Return how many commits have happened.  What an operation
+// in progress changes is on the disk once this number changes.
+uint
+logcommits(void)
+{
+  uint n;
+
+  acquire(&log.lock);
+  n = log.ncommits;
+  release(&log.lock);
+  return n;
+}
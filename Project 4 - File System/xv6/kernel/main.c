@@ -51,6 +51,7 @@ mainc(void)
   pinit();         // process table
   tvinit();        // trap vectors
   binit();         // buffer cache
+  pageinit();      // page cache
   fileinit();      // file table
   iinit();         // inode cache
   ideinit();       // disk
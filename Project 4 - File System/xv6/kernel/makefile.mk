@@ -11,11 +11,14 @@ KERNEL_OBJECTS := \
 	kalloc.o\
 	kbd.o\
 	lapic.o\
+	log.o\
 	main.o\
 	mp.o\
+	pcache.o\
 	picirq.o\
 	pipe.o\
 	proc.o\
+	sleeplock.o\
 	spinlock.o\
 	string.o\
 	swtch.o\
@@ -0,0 +1,254 @@
+// Page cache.
+//
+// The page cache holds file data a page (PGSIZE bytes) at a time,
+// indexed by (dev, inum, page number), for mmap: the pages
+// themselves are mapped into every process that maps that part
+// of the file, so reading them copies nothing.
+//
+// Interface:
+// * To get the page holding page pgno of a file, call pageget.
+//     It reads the page through readi if it is not cached.
+// * mmapuvm maps the page read-only with PTE_MAP set;
+//     copyuvm calls pagedup for each such page it maps in the
+//     child, and deallocuvm calls pageput when unmapping one.
+// * writei calls pagewrite so cached pages see every write,
+//     and itrunc calls pagedrop to forget pages past the end.
+//
+// The buffer cache is still where file data is read and written;
+// a cached page is a copy of its blocks, kept up to date by
+// pagewrite.  A page that pagedrop forgets while it is mapped
+// stays mapped, no longer in the index, until the last pageput.
+//
+// Pages come from kalloc() on demand, up to NPAGE of them.  When
+// all are in use, pageget recycles the least recently used page
+// that nobody maps.  When kalloc() runs out of memory it calls
+// pageshrink() to free one of those.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+struct page {
+  uint dev;
+  uint inum;     // 0 if not in the index
+  uint pgno;
+  int ref;       // mappings, plus callers of pageget
+  uint lastuse;  // pcache.clock when last handed out
+  char *data;    // 0 if the slot is empty
+};
+
+struct {
+  struct spinlock lock;
+  struct page page[NPAGE];
+  uint clock;
+} pcache;
+
+void
+pageinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Look up page pgno of (dev, inum).
+// Caller must hold pcache.lock.
+static struct page*
+pagefind(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+
+  for(pg = pcache.page; pg < pcache.page+NPAGE; pg++)
+    if(pg->data && pg->inum == inum && pg->dev == dev && pg->pgno == pgno)
+      return pg;
+  return 0;
+}
+
+// Find the page whose data is pa.
+// Caller must hold pcache.lock.
+static struct page*
+pagedata(char *pa)
+{
+  struct page *pg;
+
+  for(pg = pcache.page; pg < pcache.page+NPAGE; pg++)
+    if(pg->data == pa)
+      return pg;
+  panic("pagedata");
+}
+
+// Return the least recently used page that nobody maps,
+// or 0.  Caller must hold pcache.lock.
+static struct page*
+pagelru(void)
+{
+  struct page *pg, *lru;
+
+  lru = 0;
+  for(pg = pcache.page; pg < pcache.page+NPAGE; pg++)
+    if(pg->data && pg->ref == 0 && (lru == 0 || pg->lastuse < lru->lastuse))
+      lru = pg;
+  return lru;
+}
+
+// Return an empty slot, freeing the least recently used
+// page that nobody maps if there is none, or 0 if every
+// page is mapped.  Caller must hold pcache.lock.
+static struct page*
+pagevictim(void)
+{
+  struct page *pg;
+
+  for(pg = pcache.page; pg < pcache.page+NPAGE; pg++)
+    if(pg->data == 0)
+      return pg;
+  if((pg = pagelru()) != 0){
+    kfree(pg->data);
+    pg->data = 0;
+  }
+  return pg;
+}
+
+// Return the data of page pgno of ip, with a reference to it
+// that the caller must drop with pageput.  Past the end of the
+// file the page is zeros.  Returns 0 if no page is free.
+// Caller must hold ip's lock.
+char*
+pageget(struct inode *ip, uint pgno)
+{
+  struct page *pg;
+  char *mem;
+  uint n;
+
+  acquire(&pcache.lock);
+  if((pg = pagefind(ip->dev, ip->inum, pgno)) != 0)
+    goto found;
+  release(&pcache.lock);
+
+  // Fill a page without pcache.lock, since readi may sleep.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(pgno*PGSIZE < ip->size){
+    n = min(ip->size - pgno*PGSIZE, PGSIZE);
+    if(readi(ip, mem, pgno*PGSIZE, n) != n){
+      kfree(mem);
+      return 0;
+    }
+  }
+
+  acquire(&pcache.lock);
+  if((pg = pagefind(ip->dev, ip->inum, pgno)) != 0){
+    // Someone else filled it meanwhile.
+    kfree(mem);
+    goto found;
+  }
+  if((pg = pagevictim()) == 0){
+    release(&pcache.lock);
+    kfree(mem);
+    return 0;
+  }
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->pgno = pgno;
+  pg->ref = 0;
+  pg->data = mem;
+
+found:
+  pg->ref++;
+  pg->lastuse = ++pcache.clock;
+  release(&pcache.lock);
+  return pg->data;
+}
+
+// Take another reference to the cached page at pa.
+void
+pagedup(char *pa)
+{
+  acquire(&pcache.lock);
+  pagedata(pa)->ref++;
+  release(&pcache.lock);
+}
+
+// Drop a reference to the cached page at pa.
+void
+pageput(char *pa)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  pg = pagedata(pa);
+  if(pg->ref < 1)
+    panic("pageput");
+  if(--pg->ref == 0 && pg->inum == 0){
+    // pagedrop forgot it: nobody can find it again.
+    kfree(pg->data);
+    pg->data = 0;
+  }
+  release(&pcache.lock);
+}
+
+// Copy n bytes at src, just written to ip at off, into
+// the cached pages of ip that hold them.
+void
+pagewrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct page *pg;
+  uint m;
+
+  acquire(&pcache.lock);
+  for(; n > 0; n -= m, off += m, src += m){
+    m = min(n, PGSIZE - off%PGSIZE);
+    if((pg = pagefind(ip->dev, ip->inum, off/PGSIZE)) != 0)
+      memmove(pg->data + off%PGSIZE, src, m);
+  }
+  release(&pcache.lock);
+}
+
+// Forget the cached pages of ip that hold any of its data
+// at or past size.  Mapped ones are freed by the last pageput.
+void
+pagedrop(struct inode *ip, uint size)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPAGE; pg++){
+    if(pg->data == 0 || pg->inum != ip->inum || pg->dev != ip->dev)
+      continue;
+    if((pg->pgno+1)*PGSIZE <= size)
+      continue;
+    pg->inum = 0;
+    if(pg->ref == 0){
+      kfree(pg->data);
+      pg->data = 0;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Called by kalloc() when it is out of memory.
+// Free the least recently used page that nobody maps.
+// Returns 1 if a page was freed.
+int
+pageshrink(void)
+{
+  struct page *pg;
+
+  // A process filling a page is the one calling kalloc().
+  if(holding(&pcache.lock))
+    return 0;
+
+  acquire(&pcache.lock);
+  if((pg = pagelru()) != 0){
+    kfree(pg->data);
+    pg->data = 0;
+  }
+  release(&pcache.lock);
+  return pg != 0;
+}
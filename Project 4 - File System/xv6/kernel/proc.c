@@ -101,6 +101,28 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// Set up a kernel process that runs fn, which must not return.
+// It never enters user space, so it needs only the kernel
+// part of a page table.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc: no proc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kproc: out of memory?");
+
+  // Have forkret return to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -179,7 +201,9 @@ exit(void)
     }
   }
 
+  begin_op();
   iput(proc->cwd);
+  end_op();
   proc->cwd = 0;
 
   acquire(&ptable.lock);
@@ -320,8 +344,19 @@ yield(void)
 void
 forkret(void)
 {
+  static int first = 1;
+
   // Still holding ptable.lock from scheduler.
   release(&ptable.lock);
+
+  if(first){
+    // The file system must be set up in the context of a
+    // process, since reading the superblock sleeps.  Only
+    // init exists until fsinit starts fsflushd, so no other
+    // process gets here first or uses the file system early.
+    first = 0;
+    fsinit(ROOTDEV);
+  }
   
   // Return to "caller", actually trapret (see allocproc).
 }
@@ -80,6 +80,6 @@ struct proc {
 //   text
 //   original data and bss
 //   fixed-size stack
-//   expandable heap
+//   expandable heap, including files mapped by mmap
 
 #endif // _PROC_H_
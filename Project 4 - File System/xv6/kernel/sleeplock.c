@@ -0,0 +1,88 @@
+// Sleeping reader/writer locks.
+//
+// Any number of processes may hold a sleep lock shared, or one
+// may hold it exclusively.  Waiters sleep on the lock itself, so
+// releasing it wakes only them, and only if there are any.  Once
+// a process waits to hold it exclusively, new shared holders wait
+// too, so a steady stream of readers cannot starve it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+
+void
+initsleeplock(struct sleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "sleep lock");
+  lk->name = name;
+  lk->locked = 0;
+  lk->nshared = 0;
+  lk->nwait = 0;
+  lk->nwwait = 0;
+  lk->pid = 0;
+}
+
+// Acquire the lock exclusively.
+void
+acquiresleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while(lk->locked || lk->nshared > 0){
+    lk->nwait++;
+    lk->nwwait++;
+    sleep(lk, &lk->lk);
+    lk->nwwait--;
+    lk->nwait--;
+  }
+  lk->locked = 1;
+  lk->pid = proc->pid;
+  release(&lk->lk);
+}
+
+// Acquire the lock shared with other readers.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while(lk->locked || lk->nwwait > 0){
+    lk->nwait++;
+    sleep(lk, &lk->lk);
+    lk->nwait--;
+  }
+  lk->nshared++;
+  release(&lk->lk);
+}
+
+// Release the lock, however it is held.
+void
+releasesleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->locked){
+    lk->locked = 0;
+    lk->pid = 0;
+  } else if(lk->nshared > 0)
+    lk->nshared--;
+  else
+    panic("releasesleep");
+  if(lk->nwait > 0 && lk->nshared == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Does this process hold the lock exclusively?
+int
+holdingsleep(struct sleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = lk->locked && lk->pid == proc->pid;
+  release(&lk->lk);
+  return r;
+}
@@ -0,0 +1,17 @@
+#ifndef _SLEEPLOCK_H_
+#define _SLEEPLOCK_H_
+
+// Reader/writer lock for long-term holders, who sleep waiting.
+struct sleeplock {
+  struct spinlock lk; // protects this sleep lock
+  int locked;         // Held exclusively?
+  int nshared;        // Shared holders
+  int nwait;          // Processes sleeping for it
+  int nwwait;         // of which waiting to hold it exclusively
+
+  // For debugging:
+  char *name;         // Name of lock.
+  int pid;            // Process holding it exclusively.
+};
+
+#endif // _SLEEPLOCK_H_
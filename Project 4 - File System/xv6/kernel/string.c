@@ -105,9 +105,9 @@ searchKey(uchar* key, uchar* str)
 {
   int i = 0, j = 0;
   int keyLength = strlen((char*)key);
-  for (i = 0; i < BSIZE; i += 32) {
+  for (i = 0; i < TAGSIZE; i += 32) {
     j = 0;
-    for ( ; j < 10 && i + j < BSIZE && key[j] && str[i + j] && key[j] == str[i + j]; j++) ;
+    for ( ; j < 10 && i + j < TAGSIZE && key[j] && str[i + j] && key[j] == str[i + j]; j++) ;
     if (j == keyLength && !key[j] && !str[i + j]) return i + j - keyLength;
   }
   return -1;
@@ -117,7 +117,7 @@ int
 searchEnd(uchar* str)
 {
   int i = 0;
-  for (i = 0; i < BSIZE && str[i]; i += 32) ;
-  if (i == BSIZE) return -1;
+  for (i = 0; i < TAGSIZE && str[i]; i += 32) ;
+  if (i == TAGSIZE) return -1;
   return i;
 }
\ No newline at end of file
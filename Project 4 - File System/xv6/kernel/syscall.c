@@ -64,6 +64,18 @@ argptr(int n, char **pp, int size)
   return 0;
 }
 
+// Like argptr, for a block of memory the kernel will write.
+// Also check that none of it is mapped read-only by mmap.
+int
+argoutptr(int n, char **pp, int size)
+{
+  if(argptr(n, pp, size) < 0)
+    return -1;
+  if(!uvmwritable(proc->pgdir, (uint)*pp, size))
+    return -1;
+  return 0;
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -108,6 +120,14 @@ static int (*syscalls[])(void) = {
 [SYS_getFileTag] sys_getFileTag,
 [SYS_getAllTags] sys_getAllTags,
 [SYS_getFilesByTag] sys_getFilesByTag,
+[SYS_sync]    sys_sync,
+[SYS_fsync]   sys_fsync,
+[SYS_statfs]  sys_statfs,
+[SYS_ftruncate] sys_ftruncate,
+[SYS_mmap]    sys_mmap,
+[SYS_lseek]   sys_lseek,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
 };
 
 // Called on a syscall trap. Checks that the syscall number (passed via eax)
@@ -5,6 +5,8 @@
 #include "mmu.h"
 #include "proc.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
 #include "sysfunc.h"
@@ -65,7 +67,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argoutptr(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -82,6 +84,46 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Read n bytes at offset off, without moving the file offset,
+// so threads sharing a descriptor can read it independently.
+int
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0 ||
+     argoutptr(1, &p, n) < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+// Write n bytes at offset off, without moving the file offset.
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0 ||
+     argptr(1, &p, n) < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+int
+sys_lseek(void)
+{
+  struct file *f;
+  int off, whence;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &whence) < 0)
+    return -1;
+  return fileseek(f, off, whence);
+}
+
 int
 sys_close(void)
 {
@@ -101,11 +143,96 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
   
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argoutptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
 
+// Write all delayed writes back to disk.
+int
+sys_sync(void)
+{
+  fssync();
+  return 0;
+}
+
+// Write f's delayed writes back to disk.  The buffer cache
+// does not know which file a block belongs to, so this
+// writes back everything, as sync does.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  fssync();
+  return 0;
+}
+
+int
+sys_statfs(void)
+{
+  struct statfs *st;
+
+  if(argoutptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  fsstat(st);
+  return 0;
+}
+
+// Set the size of open file fd, freeing blocks past the new end
+// or leaving a hole up to it.
+int
+sys_ftruncate(void)
+{
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->writable || f->ip->type != T_FILE)
+    return -1;
+  if(n < 0 || n > MAXFILE*BSIZE)
+    return -1;
+  begin_op();
+  ilock(f->ip);
+  itrunc(f->ip, n);
+  iunlock(f->ip);
+  end_op();
+  return 0;
+}
+
+// Map len bytes of f, from page-aligned offset off, read-only
+// into the process, just past the end of its memory, which
+// grows to cover them.  Returns the address of the mapping.
+// sbrk shrinking the process unmaps it again.
+int
+sys_mmap(void)
+{
+  struct file *f;
+  int off, len, r;
+  uint va;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &len) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable || f->ip->type != T_FILE)
+    return -1;
+  if(off < 0 || off % PGSIZE != 0 || len <= 0)
+    return -1;
+  va = PGROUNDUP(proc->sz);
+  if(len > USERTOP - va)
+    return -1;
+  ilockshared(f->ip);
+  r = mmapuvm(proc->pgdir, (char*)va, f->ip, off, len);
+  iunlock(f->ip);
+  if(r < 0)
+    return -1;
+  proc->sz = PGROUNDUP(va + len);
+  switchuvm(proc);
+  return va;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -115,11 +242,25 @@ sys_link(void)
 
   if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
     return -1;
-  if((ip = namei(old)) == 0)
+
+  begin_op();
+  if((ip = namei(old)) == 0){
+    end_op();
     return -1;
+  }
+
+  // Make room for new before changing anything:
+  // dirroom may end this operation and begin another.
+  if((dp = nameiparent(new, name)) != 0){
+    ilock(dp);
+    dirroom(dp, name);
+    iunlockput(dp);
+  }
+
   ilock(ip);
   if(ip->type == T_DIR){
     iunlockput(ip);
+    end_op();
     return -1;
   }
   ip->nlink++;
@@ -135,6 +276,9 @@ sys_link(void)
   }
   iunlockput(dp);
   iput(ip);
+
+  end_op();
+
   return 0;
 
 bad:
@@ -142,6 +286,7 @@ bad:
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
+  end_op();
   return -1;
 }
 
@@ -171,33 +316,34 @@ sys_unlink(void)
 
   if(argstr(0, &path) < 0)
     return -1;
-  if((dp = nameiparent(path, name)) == 0)
+
+  begin_op();
+  if((dp = nameiparent(path, name)) == 0){
+    end_op();
     return -1;
+  }
+
   ilock(dp);
 
   // Cannot unlink "." or "..".
-  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0){
-    iunlockput(dp);
-    return -1;
-  }
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    goto bad;
 
-  if((ip = dirlookup(dp, name, &off)) == 0){
-    iunlockput(dp);
-    return -1;
-  }
+  if((ip = dirlookup(dp, name, &off)) == 0)
+    goto bad;
   ilock(ip);
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
   if(ip->type == T_DIR && !isdirempty(ip)){
     iunlockput(ip);
-    iunlockput(dp);
-    return -1;
+    goto bad;
   }
 
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheset(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -207,7 +353,15 @@ sys_unlink(void)
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
+
+  end_op();
+
   return 0;
+
+bad:
+  iunlockput(dp);
+  end_op();
+  return -1;
 }
 
 static struct inode*
@@ -220,6 +374,12 @@ create(char *path, short type, short major, short minor)
   if((dp = nameiparent(path, name)) == 0)
     return 0;
   ilock(dp);
+  // Before anything changes: dirroom may end this
+  // operation and begin another.
+  if(dirroom(dp, name) < 0){
+    iunlockput(dp);
+    return 0;
+  }
 
   if((ip = dirlookup(dp, name, &off)) != 0){
     iunlockput(dp);
@@ -230,7 +390,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0)
     panic("create: ialloc");
 
   ilock(ip);
@@ -247,8 +407,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // No room in dp: free ip again.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
   return ip;
@@ -264,15 +434,23 @@ sys_open(void)
 
   if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
     return -1;
+
+  begin_op();
+
   if(omode & O_CREATE){
-    if((ip = create(path, T_FILE, 0, 0)) == 0)
+    if((ip = create(path, T_FILE, 0, 0)) == 0){
+      end_op();
       return -1;
+    }
   } else {
-    if((ip = namei(path)) == 0)
+    if((ip = namei(path)) == 0){
+      end_op();
       return -1;
+    }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
+      end_op();
       return -1;
     }
   }
@@ -281,13 +459,18 @@ sys_open(void)
     if(f)
       fileclose(f);
     iunlockput(ip);
+    end_op();
     return -1;
   }
   iunlock(ip);
+  end_op();
 
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
+  f->raoff = 0;
+  f->rawin = 0;
+  f->rablock = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
   return fd;
@@ -299,9 +482,13 @@ sys_mkdir(void)
   char *path;
   struct inode *ip;
 
-  if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0)
+  begin_op();
+  if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
+    end_op();
     return -1;
+  }
   iunlockput(ip);
+  end_op();
   return 0;
 }
 
@@ -313,12 +500,16 @@ sys_mknod(void)
   int len;
   int major, minor;
   
+  begin_op();
   if((len=argstr(0, &path)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
-     (ip = create(path, T_DEV, major, minor)) == 0)
+     (ip = create(path, T_DEV, major, minor)) == 0){
+    end_op();
     return -1;
+  }
   iunlockput(ip);
+  end_op();
   return 0;
 }
 
@@ -328,15 +519,20 @@ sys_chdir(void)
   char *path;
   struct inode *ip;
 
-  if(argstr(0, &path) < 0 || (ip = namei(path)) == 0)
+  begin_op();
+  if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
+    end_op();
     return -1;
+  }
   ilock(ip);
   if(ip->type != T_DIR){
     iunlockput(ip);
+    end_op();
     return -1;
   }
   iunlock(ip);
   iput(proc->cwd);
+  end_op();
   proc->cwd = ip;
   return 0;
 }
@@ -374,7 +570,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argoutptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
@@ -402,8 +598,12 @@ sys_tagFile(void)
   if (argint(0, &fileDescriptor) < 0) return -1;
   if (argstr(1, &key) < 0) return -1;
   if (argstr(2, &value) < 0) return -1;
+  int r;
   if (argint(3, &valueLength) < 0) return -1;
-  return tagFile(fileDescriptor, key, value, valueLength);
+  begin_op();
+  r = tagFile(fileDescriptor, key, value, valueLength);
+  end_op();
+  return r;
 }
 
 int
@@ -427,9 +627,13 @@ sys_getFileTag(void)
   int length;
   if (argint(0, &fileDescriptor) < 0) return -1;
   if (argstr(1, &key) < 0) return -1;
-  if (argstr(2, &buffer) < 0) return -1;
-  if (argint(3, &length) < 0) return -1;
-  return getFileTag(fileDescriptor, key, buffer, length);
+  int r;
+  if (argint(3, &length) < 0 || length < 0) return -1;
+  if (argoutptr(2, &buffer, length) < 0) return -1;
+  begin_op();  // may allocate the tag block
+  r = getFileTag(fileDescriptor, key, buffer, length);
+  end_op();
+  return r;
 }
 
 int
@@ -440,9 +644,13 @@ sys_getAllTags(void)
   struct Key *keys;
   int maxTags;
   if (argint(0, &fileDescriptor) < 0) return -1;
-  if (argptr(1, (char**)&keys, sizeof(struct Key) * maxTags) < 0) return -1;
-  if (argint(2, &maxTags) < 0) return -1;
-  return getAllTags(fileDescriptor, keys, maxTags);
+  int r;
+  if (argint(2, &maxTags) < 0 || maxTags < 0) return -1;
+  if (argoutptr(1, (char**)&keys, sizeof(struct Key) * maxTags) < 0) return -1;
+  begin_op();  // may allocate the tag block
+  r = getAllTags(fileDescriptor, keys, maxTags);
+  end_op();
+  return r;
 }
 
 int
@@ -457,7 +665,7 @@ sys_getFilesByTag(void)
   if (argstr(0, &key) < 0) return -1;
   if (argstr(1, &value) < 0) return -1;
   if (argint(2, &valueLength) < 0) return -1;
-  if (argstr(3, &results) < 0) return -1;
-  if (argint(4, &resultsLength)) return -1;
+  if (argint(4, &resultsLength) || resultsLength < 0) return -1;
+  if (argoutptr(3, &results, resultsLength) < 0) return -1;
   return getFilesByTag(key, value, valueLength, results, resultsLength);
 }
\ No newline at end of file
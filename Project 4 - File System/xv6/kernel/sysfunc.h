@@ -28,4 +28,12 @@ int sys_removeFileTag(void);
 int sys_getFileTag(void);
 int sys_getAllTags(void);
 int sys_getFilesByTag(void);
+int sys_sync(void);
+int sys_fsync(void);
+int sys_statfs(void);
+int sys_ftruncate(void);
+int sys_mmap(void);
+int sys_lseek(void);
+int sys_pread(void);
+int sys_pwrite(void);
 #endif // _SYSFUNC_H_
\ No newline at end of file
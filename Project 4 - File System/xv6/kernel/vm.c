@@ -5,6 +5,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "fs.h"
 
 extern char data[];  // defined in data.S
 
@@ -209,6 +210,7 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 
   if((uint)addr % PGSIZE != 0)
     panic("loaduvm: addr must be page aligned");
+  ireadahead(ip, offset/BSIZE, (offset%BSIZE + sz + BSIZE-1)/BSIZE);
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
       panic("loaduvm: address should exist");
@@ -223,6 +225,33 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
   return 0;
 }
 
+// Map sz bytes of ip's data, from page-aligned offset, read-only
+// at page-aligned addr in pgdir.  The pages are the page cache's,
+// shared with every other mapping of them, so nothing is copied.
+// Caller must hold ip's lock.
+int
+mmapuvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+{
+  uint i;
+  char *mem;
+
+  if((uint)addr % PGSIZE != 0 || offset % PGSIZE != 0)
+    panic("mmapuvm: not page aligned");
+  for(i = 0; i < sz; i += PGSIZE){
+    if((mem = pageget(ip, (offset+i)/PGSIZE)) == 0)
+      goto bad;
+    if(mappages(pgdir, addr+i, PGSIZE, PADDR(mem), PTE_U|PTE_MAP) < 0){
+      pageput(mem);
+      goto bad;
+    }
+  }
+  return 0;
+
+bad:
+  deallocuvm(pgdir, (uint)addr+i, (uint)addr);
+  return -1;
+}
+
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -270,7 +299,10 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      kfree((char*)pa);
+      if(*pte & PTE_MAP)
+        pageput((char*)pa);
+      else
+        kfree((char*)pa);
       *pte = 0;
     }
   }
@@ -312,6 +344,15 @@ copyuvm(pde_t *pgdir, uint sz)
     if(!(*pte & PTE_P))
       panic("copyuvm: page not present");
     pa = PTE_ADDR(*pte);
+    if(*pte & PTE_MAP){
+      // Share the page cache page.
+      pagedup((char*)pa);
+      if(mappages(d, (void*)i, PGSIZE, pa, PTE_U|PTE_MAP) < 0){
+        pageput((char*)pa);
+        goto bad;
+      }
+      continue;
+    }
     if((mem = kalloc()) == 0)
       goto bad;
     memmove(mem, (char*)pa, PGSIZE);
@@ -339,6 +380,30 @@ uva2ka(pde_t *pgdir, char *uva)
   return (char*)PTE_ADDR(*pte);
 }
 
+// Return 1 if user addresses va through va+len-1 in pgdir are
+// all on writable pages, 0 if any is on a page mapped by mmap.
+// The kernel writes user memory without page protection, so
+// must check before writing where a user pointer says.
+int
+uvmwritable(pde_t *pgdir, uint va, uint len)
+{
+  char *a, *last;
+  pte_t *pte;
+
+  if(len == 0)
+    return 1;
+  a = PGROUNDDOWN(va);
+  last = PGROUNDDOWN(va + len - 1);
+  for(;;){
+    if((pte = walkpgdir(pgdir, a, 0)) == 0 || (*pte & PTE_W) == 0)
+      return 0;
+    if(a == last)
+      break;
+    a += PGSIZE;
+  }
+  return 1;
+}
+
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.
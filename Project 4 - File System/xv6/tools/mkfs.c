@@ -12,33 +12,41 @@
 #define stat xv6_stat  // avoid clash with host struct stat
 #define dirent xv6_dirent  // avoid clash with host struct stat
 #include "types.h"
+#include "param.h"
 #include "fs.h"
 #include "stat.h"
 #undef stat
 #undef dirent
+#undef DPB  // struct dirent is the host's from here on
+#define DPB (BSIZE / sizeof(struct xv6_dirent))
 
-#define BLOCK_SIZE (512)
+#define MAXDIRB (NDIRECT + NINDIRECT)  // largest directory mkfs lays out, in blocks
 
-int nblocks = 995;
+int nblocks;
 int ninodes = 200;
-int size = 1024;
+int size = 2048;
+int ngroups = 4;
+uint bpg;  // blocks per group
+uint ipg;  // inodes per group
+int nlog = LOGSIZE + 1;  // log header and blocks
+uint gstart;  // first block of group 0
 
 int fsfd;
 struct superblock sb;
-char zeroes[512];
+char zeroes[BSIZE];
 uint freeblock;
-uint usedblocks;
-uint bitblocks;
 uint freeinode = 1;
 uint root_inode;
 
-void balloc(int);
+uint balloc(void);
+uint dalloc(void);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct xv6_dirent *de, int n);
 
 // convert to intel byte order
 ushort
@@ -64,33 +72,43 @@ xint(uint x)
 }
 
 
-int 
-mkfs(int nblocks, int ninodes, int size) {
-
+int
+mkfs(void)
+{
   int i;
-  char buf[BLOCK_SIZE];
+  char buf[BSIZE];
+
+  // Split the disk after the superblock and the log into ngroups
+  // groups, and the inodes evenly among them, in whole blocks.
+  gstart = 2 + nlog;
+  bpg = (size - gstart + ngroups-1) / ngroups;
+  ipg = (ninodes + ngroups*IPB - 1) / (ngroups*IPB) * IPB;
+  ninodes = ngroups * ipg;
+  nblocks = size - gstart - ngroups*(ipg/IPB + 1);
+  assert(bpg <= BPB && bpg > ipg/IPB + 1);
 
   sb.size = xint(size);
-  sb.nblocks = xint(nblocks); // so whole disk is size sectors
+  sb.nblocks = xint(nblocks);
   sb.ninodes = xint(ninodes);
+  sb.ngroups = xint(ngroups);
+  sb.bpg = xint(bpg);
+  sb.ipg = xint(ipg);
+  sb.logstart = xint(2);
+  sb.nlog = xint(nlog);
+  sb.bsize = xint(BSIZE);
 
-  bitblocks = size/(512*8) + 1;
-  usedblocks = ninodes / IPB + 3 + bitblocks;
-  freeblock = usedblocks;
+  freeblock = gstart + ipg/IPB + 1;
 
-  printf("used %d (bit %d ninode %zu) free %u total %d\n", usedblocks,
-         bitblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
+  printf("%d log blocks; %d groups of %u blocks, %u inodes; %d data blocks of %d\n",
+         nlog, ngroups, bpg, ipg, nblocks, size);
 
-  assert(nblocks + usedblocks == size);
-
-  for(i = 0; i < nblocks + usedblocks; i++)
+  for(i = 0; i < size; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
 
-
   return 0;
 }
 
@@ -100,25 +118,31 @@ add_dir(DIR *cur_dir, int cur_inode, int parent_inode) {
 	int child_inode;
 	int cur_fd, child_fd;
 	struct xv6_dirent de;
-	struct dinode din;
 	struct dirent dir_buf;
 	struct dirent *entry;
 	struct stat st;
 	int bytes_read;
-	char buf[BLOCK_SIZE];
-	int off;
+	char buf[BSIZE];
+	struct xv6_dirent *ents;
+	int nents;
+
+	// Collect the entries, to lay them out once they are all known.
+	ents = calloc(MAXDIRB*DPB, sizeof(*ents));
+	if (ents == NULL) {
+		perror("add_dir");
+		exit(EXIT_FAILURE);
+	}
+	nents = 0;
 
-	bzero(&de, sizeof(de));
-	de.inum = xshort(cur_inode);
-	strcpy(de.name, ".");
-	iappend(cur_inode, &de, sizeof(de));
+	ents[nents].inum = xshort(cur_inode);
+	strcpy(ents[nents++].name, ".");
 
-	bzero(&de, sizeof(de));
-	de.inum = xshort(parent_inode);
-	strcpy(de.name, "..");
-	iappend(cur_inode, &de, sizeof(de));
+	ents[nents].inum = xshort(parent_inode);
+	strcpy(ents[nents++].name, "..");
 
 	if (cur_dir == NULL) {
+		wdir(cur_inode, ents, nents);
+		free(ents);
 		return 0;
 	}
 
@@ -179,21 +203,90 @@ add_dir(DIR *cur_dir, int cur_inode, int parent_inode) {
 		}
 		close(child_fd);
 
-		de.inum = xshort(child_inode);
-		strncpy(de.name, entry->d_name, DIRSIZ);
-		iappend(cur_inode, &de, sizeof(de));
+		assert(nents < MAXDIRB*DPB);
+		ents[nents].inum = xshort(child_inode);
+		strncpy(ents[nents++].name, entry->d_name, DIRSIZ);
 
 	}
 
-	// fix size of inode cur_dir
-	rinode(cur_inode, &din);
-	off = xint(din.size);
-	off = ((off/BSIZE) + 1) * BSIZE;
-	din.size = xint(off);
-	winode(cur_inode, &din);
+	wdir(cur_inode, ents, nents);
+	free(ents);
 	return 0;
 }
 
+// Same as dirhash in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Same as dirbucket in kernel/fs.c.
+uint
+dirbucket(uint h, uint nb)
+{
+  uint m;
+
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  if(h % m < nb - m)
+    return h % (2*m);
+  return h % m;
+}
+
+// Write the n entries de of directory inum, "." and ".." first.
+// If they fit in one block, the directory is linear.  Otherwise
+// it is hashed (see fs.h), with as few buckets as hold them all.
+void
+wdir(uint inum, struct xv6_dirent *de, int n)
+{
+  struct xv6_dirent *blocks;
+  struct dinode din;
+  uint nb, b, used[MAXDIRB];
+  int i;
+
+  if(n <= DPB){
+    iappend(inum, de, n*sizeof(*de));
+    // round size up to the block, leaving free entries
+    rinode(inum, &din);
+    din.size = xint(BSIZE);
+    winode(inum, &din);
+    return;
+  }
+
+  blocks = calloc(MAXDIRB*DPB, sizeof(*blocks));
+  for(nb = 2; nb <= MAXDIRB; nb++){
+    bzero(blocks, nb*BSIZE);
+    bzero(used, sizeof(used));
+    blocks[0] = de[0];
+    blocks[1] = de[1];
+    used[0] = 2;
+    for(i = 2; i < n; i++){
+      b = dirbucket(dirhash(de[i].name), nb);
+      if(used[b] == DPB)
+        break;
+      blocks[b*DPB + used[b]++] = de[i];
+    }
+    if(i == n)
+      break;
+  }
+  assert(nb <= MAXDIRB);
+
+  iappend(inum, blocks, nb*BSIZE);
+  rinode(inum, &din);
+  din.major = xshort(nb);
+  winode(inum, &din);
+  free(blocks);
+}
+
 
 
 
@@ -202,14 +295,16 @@ main(int argc, char *argv[])
 {
   int r;
   DIR *root_dir;
+  char buf[BSIZE];
 
   if(argc < 2){
     fprintf(stderr, "Usage: mkfs fs.img files...\n");
     exit(1);
   }
 
-  assert((512 % sizeof(struct dinode)) == 0);
-  assert((512 % sizeof(struct xv6_dirent)) == 0);
+  assert((BSIZE % 512) == 0 && BSIZE <= 4096);
+  assert((BSIZE % sizeof(struct dinode)) == 0);
+  assert((BSIZE % sizeof(struct xv6_dirent)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -217,7 +312,7 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  mkfs(995, 200, 1024);
+  mkfs();
 
   root_dir = opendir(argv[2]);
 
@@ -229,7 +324,12 @@ main(int argc, char *argv[])
     exit(EXIT_FAILURE);
   }
 
-  balloc(usedblocks);
+  // Record what is left free, now that everything is allocated.
+  sb.nfreeblocks = xint(balloc());
+  sb.nfreeinodes = xint(ninodes - freeinode);
+  memset(buf, 0, sizeof(buf));
+  memmove(buf, &sb, sizeof(sb));
+  wsect(1, buf);
 
   exit(0);
 }
@@ -237,11 +337,11 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
     perror("lseek");
     exit(1);
   }
-  if(write(fsfd, buf, 512) != 512){
+  if(write(fsfd, buf, BSIZE) != BSIZE){
     perror("write");
     exit(1);
   }
@@ -250,13 +350,13 @@ wsect(uint sec, void *buf)
 uint
 i2b(uint inum)
 {
-  return (inum / IPB) + 2;
+  return gstart + inum/ipg*bpg + inum%ipg/IPB;
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[512];
+  char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -270,7 +370,7 @@ winode(uint inum, struct dinode *ip)
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[512];
+  char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -283,11 +383,11 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
     perror("lseek");
     exit(1);
   }
-  if(read(fsfd, buf, 512) != 512){
+  if(read(fsfd, buf, BSIZE) != BSIZE){
     perror("read");
     exit(1);
   }
@@ -303,35 +403,87 @@ ialloc(ushort type)
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(EXTENTS)
+    din.flags = xint(DI_EXTENTS);
   winode(inum, &din);
   return inum;
 }
 
-void
-balloc(int used)
+// Write each group's bitmap, in which its inode and bitmap
+// blocks, the data blocks below freeblock and any blocks past
+// the end of the disk are in use.  Return the number free.
+uint
+balloc(void)
 {
-  uchar buf[512];
-  int i;
-
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < 512*8);
-  bzero(buf, 512);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  uchar buf[BSIZE];
+  uint g, i, b, nfree;
+
+  printf("balloc: first %u blocks have been allocated\n", freeblock);
+  nfree = 0;
+  for(g = 0; g < ngroups; g++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB; i++){
+      b = gstart + g*bpg + i;
+      if(i <= ipg/IPB || b < freeblock || i >= bpg || b >= size)
+        buf[i/8] |= 1 << (i%8);
+      else
+        nfree++;
+    }
+    wsect(gstart + g*bpg + ipg/IPB, buf);
   }
-  printf("balloc: write bitmap block at sector %zu\n", ninodes/IPB + 3);
-  wsect(ninodes / IPB + 3, buf);
+  return nfree;
+}
+
+// Allocate the next data block, skipping the inode and
+// bitmap blocks at the start of each group.
+uint
+dalloc(void)
+{
+  uint first;
+
+  first = gstart + (freeblock - gstart)/bpg*bpg + ipg/IPB + 1;
+  if(freeblock < first)
+    freeblock = first;
+  assert(freeblock < size);
+  return freeblock++;
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of extent inode din,
+// allocating it if fbn is the next block of the file.
+uint
+eappend(struct dinode *din, uint fbn)
+{
+  struct extent *e;
+  uint i, off, b;
+
+  e = (struct extent*)din->addrs;
+  off = 0;
+  for(i = 0; i < NEXTENT && xint(e[i].len) > 0; i++){
+    if(fbn < off + xint(e[i].len))
+      return xint(e[i].start) + fbn - off;
+    off += xint(e[i].len);
+  }
+  assert(fbn == off);
+  b = dalloc();
+  if(i > 0 && xint(e[i-1].start) + xint(e[i-1].len) == b)
+    e[i-1].len = xint(xint(e[i-1].len) + 1);
+  else {
+    assert(i < NEXTENT);
+    e[i].start = xint(b);
+    e[i].len = xint(1);
+  }
+  return b;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[512];
+  char buf[BSIZE];
   uint indirect[NINDIRECT];
   uint x;
 
@@ -339,32 +491,31 @@ iappend(uint inum, void *xp, int n)
 
   off = xint(din.size);
   while(n > 0){
-    fbn = off / 512;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    fbn = off / BSIZE;
+    assert(fbn < NDIRECT + NINDIRECT);  // no double indirect blocks here
+    if(xint(din.flags) & DI_EXTENTS){
+      x = eappend(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-        usedblocks++;
+        din.addrs[fbn] = xint(dalloc());
       }
       x = xint(din.addrs[fbn]);
     } else {
       if(xint(din.addrs[NDIRECT]) == 0){
         // printf("allocate indirect block\n");
-        din.addrs[NDIRECT] = xint(freeblock++);
-        usedblocks++;
+        din.addrs[NDIRECT] = xint(dalloc());
       }
       // printf("read indirect block\n");
       rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        usedblocks++;
+        indirect[fbn - NDIRECT] = xint(dalloc());
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * 512 - off);
+    n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * 512), n1);
+    bcopy(p, buf + off - (fbn * BSIZE), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
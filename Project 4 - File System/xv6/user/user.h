@@ -2,6 +2,7 @@
 #define _USER_H_
 
 struct stat;
+struct statfs;
 
 #ifndef _KEY_H_
 #define _KEY_H_
@@ -37,6 +38,14 @@ int removeFileTag(int fileDescriptor, char* key);
 int getFileTag(int fileDescriptor, char* key, char* buffer, int length);
 int getAllTags(int fileDescriptor, struct Key *keys, int maxTags);
 int getFilesByTag(char* key, char* value, int valueLength, char* results, int resultsLength);
+int sync(void);
+int fsync(int);
+int statfs(struct statfs*);
+int ftruncate(int, int);
+void* mmap(int, int, int);
+int lseek(int, int, int);
+int pread(int, void*, int, int);
+int pwrite(int, void*, int, int);
 
 // user library functions (ulib.c)
 int stat(char*, struct stat*);
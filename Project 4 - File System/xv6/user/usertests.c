@@ -9,6 +9,9 @@
 
 #define PAGE (4096)
 #define MAX_PROC_MEM (640 * 1024)
+// 512-byte writes in writetest1's file, which reaches the
+// doubly-indirect blocks whatever BSIZE is
+#define NBIG ((NDIRECT + NINDIRECT + 64) * (BSIZE/512))
 
 char buf[2048];
 char name[3];
@@ -99,7 +102,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -119,7 +122,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == NBIG - 1){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -1071,6 +1074,673 @@ fourteen(void)
   printf(1, "ok\n");
 }
 
+// writes are delayed in the buffer cache; sync and fsync
+// must push them out without disturbing the file.
+void
+synctest(void)
+{
+  int fd, i;
+  char buf[512];
+
+  printf(1, "sync test\n");
+
+  fd = open("syncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "create syncfile failed\n");
+    exit();
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a'+i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "write syncfile failed\n");
+      exit();
+    }
+    if(i == 10 && fsync(fd) != 0){
+      printf(1, "fsync failed\n");
+      exit();
+    }
+  }
+  if(fsync(-1) >= 0 || fsync(99) >= 0){
+    printf(1, "fsync of a bad fd succeeded\n");
+    exit();
+  }
+  close(fd);
+  if(sync() != 0){
+    printf(1, "sync failed\n");
+    exit();
+  }
+
+  fd = open("syncfile", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+       buf[0] != 'a'+i || buf[sizeof(buf)-1] != 'a'+i){
+      printf(1, "syncfile block %d wrong\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("syncfile");
+
+  printf(1, "sync ok\n");
+}
+
+// free counts from statfs follow allocation and freeing.
+void
+statfstest(void)
+{
+  struct statfs st0, st1, st2;
+  int fd, i;
+  char buf[512];
+
+  printf(1, "statfs test\n");
+
+  // Create first: adding the name may grow the directory.
+  fd = open("statfsfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "create statfsfile failed\n");
+    exit();
+  }
+  if(statfs(&st0) != 0 || st0.bsize != BSIZE ||
+     st0.bfree > st0.blocks || st0.ffree > st0.files){
+    printf(1, "statfs failed\n");
+    exit();
+  }
+
+  memset(buf, 's', sizeof(buf));
+  for(i = 0; i < 4*BSIZE/sizeof(buf); i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+  statfs(&st1);
+  if(st1.bfree != st0.bfree - 4 || st1.ffree != st0.ffree){
+    printf(1, "statfs: free %d/%d after write, was %d/%d\n",
+           st1.bfree, st1.ffree, st0.bfree, st0.ffree);
+    exit();
+  }
+
+  unlink("statfsfile");
+  statfs(&st2);
+  if(st2.bfree != st0.bfree || st2.ffree != st0.ffree + 1){
+    printf(1, "statfs: free %d/%d after unlink, was %d/%d\n",
+           st2.bfree, st2.ffree, st0.bfree, st0.ffree);
+    exit();
+  }
+
+  printf(1, "statfs ok\n");
+}
+
+// growing a file with ftruncate leaves a hole that reads as
+// zeros and takes no blocks; shrinking frees blocks.
+void
+sparsetest(void)
+{
+  struct statfs st0, st1;
+  int fd, i;
+  char buf[512];
+
+  printf(1, "sparse test\n");
+
+  fd = open("sparsefile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "create sparsefile failed\n");
+    exit();
+  }
+  memset(buf, 'p', sizeof(buf));
+  write(fd, buf, 200);  // too big to be inline, so it takes a block
+  close(fd);
+  fd = open("sparsefile", O_RDWR);
+  statfs(&st0);
+  if(ftruncate(fd, 200*512) != 0){
+    printf(1, "ftruncate grow failed\n");
+    exit();
+  }
+  statfs(&st1);
+  if(st1.bfree != st0.bfree){
+    printf(1, "sparse: hole took %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+  close(fd);
+
+  fd = open("sparsefile", O_RDONLY);
+  for(i = 0; i < 200; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+       buf[0] != (i == 0 ? 'p' : 0) || buf[200] != 0){
+      printf(1, "sparse: bad block %d\n", i);
+      exit();
+    }
+  }
+  statfs(&st1);
+  if(read(fd, buf, sizeof(buf)) != 0 || st1.bfree != st0.bfree){
+    printf(1, "sparse: read past end or allocated\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("sparsefile", O_RDWR);
+  if(ftruncate(fd, 5) != 0 || ftruncate(fd, -1) >= 0){
+    printf(1, "ftruncate shrink failed\n");
+    exit();
+  }
+  if(read(fd, buf, sizeof(buf)) != 5 || buf[4] != 'p'){
+    printf(1, "sparse: bad read after shrink\n");
+    exit();
+  }
+  close(fd);
+  unlink("sparsefile");
+
+  printf(1, "sparse ok\n");
+}
+
+// blocks appended to a file are allocated when it is closed,
+// and never if it is removed first.
+void
+dalloctest(void)
+{
+  struct statfs st0, st1;
+  int fd, i;
+  char buf[512];
+
+  printf(1, "delayed allocation test\n");
+
+  memset(buf, 'd', sizeof(buf));
+  fd = open("dallocfile", O_CREATE|O_RDWR);
+  statfs(&st0);
+  for(i = 0; i < 4*BSIZE/sizeof(buf); i++)
+    write(fd, buf, sizeof(buf));
+  statfs(&st1);
+  if(st1.bfree != st0.bfree){
+    printf(1, "dalloc: write allocated %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+  unlink("dallocfile");
+  close(fd);
+  statfs(&st1);
+  if(st1.bfree != st0.bfree){
+    printf(1, "dalloc: removed file allocated %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+
+  fd = open("dallocfile", O_CREATE|O_RDWR);
+  for(i = 0; i < 4*BSIZE/sizeof(buf); i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+  statfs(&st1);
+  if(st1.bfree != st0.bfree - 4){
+    printf(1, "dalloc: close allocated %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+  fd = open("dallocfile", O_RDONLY);
+  for(i = 0; i < 4*BSIZE/sizeof(buf); i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'd' || buf[511] != 'd'){
+      printf(1, "dalloc: bad read %d\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("dallocfile");
+
+  printf(1, "delayed allocation ok\n");
+}
+
+// Whole-block writes replace a block without reading it;
+// partial writes must still keep the rest of the block.
+void
+overwritetest(void)
+{
+  int fd, i;
+  static char buf[BSIZE];  // one block; too big for the stack
+
+  printf(1, "overwrite test\n");
+
+  fd = open("owfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "overwrite: create failed\n");
+    exit();
+  }
+  memset(buf, 'a', sizeof(buf));
+  for(i = 0; i < 3; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+
+  fd = open("owfile", O_RDWR);
+  memset(buf, 'b', sizeof(buf));
+  write(fd, buf, sizeof(buf));   // all of block 0
+  write(fd, buf, 100);           // start of block 1
+  close(fd);
+
+  fd = open("owfile", O_RDONLY);
+  for(i = 0; i < 3; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "overwrite: read failed\n");
+      exit();
+    }
+    if(buf[0] != (i < 2 ? 'b' : 'a') || buf[99] != buf[0] ||
+       buf[100] != (i == 0 ? 'b' : 'a') || buf[BSIZE-1] != buf[100]){
+      printf(1, "overwrite: block %d wrong\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("owfile");
+
+  printf(1, "overwrite ok\n");
+}
+
+// Tiny files and directories live in the inode and take no
+// blocks, until they grow too big for it.
+void
+inlinetest(void)
+{
+  struct statfs st0, st1;
+  int fd, i;
+  char buf[300];
+
+  printf(1, "inline test\n");
+
+  fd = open("inlinefile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "inline: create failed\n");
+    exit();
+  }
+  statfs(&st0);
+  if(mkdir("inlinedir") != 0 || write(fd, "tiny config\n", 12) != 12){
+    printf(1, "inline: mkdir or write failed\n");
+    exit();
+  }
+  close(fd);
+  statfs(&st1);
+  if(st1.bfree != st0.bfree){
+    printf(1, "inline: took %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+  fd = open("inlinefile", O_RDWR);
+  if(read(fd, buf, sizeof(buf)) != 12 || buf[0] != 't' || buf[11] != '\n'){
+    printf(1, "inline: read back failed\n");
+    exit();
+  }
+
+  // Grow it out of the inode.
+  memset(buf, 'i', sizeof(buf));
+  write(fd, buf, sizeof(buf));
+  close(fd);
+  statfs(&st1);
+  if(st1.bfree != st0.bfree - 1){
+    printf(1, "inline: grown file took %d blocks\n", st0.bfree - st1.bfree);
+    exit();
+  }
+  fd = open("inlinefile", O_RDONLY);
+  if(read(fd, buf, 12) != 12 || buf[4] != ' ' ||
+     read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[299] != 'i'){
+    printf(1, "inline: read after growing failed\n");
+    exit();
+  }
+  close(fd);
+
+  // So does a directory, as entries are added.
+  for(i = 0; i < 10; i++){
+    buf[0] = 'a' + i;
+    buf[1] = 0;
+    if(chdir("inlinedir") != 0 || mkdir(buf) != 0 || chdir("..") != 0){
+      printf(1, "inline: mkdir in dir failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 10; i++){
+    buf[0] = 'a' + i;
+    buf[1] = 0;
+    if(chdir("inlinedir") != 0 || unlink(buf) != 0 || chdir("..") != 0){
+      printf(1, "inline: unlink in dir failed\n");
+      exit();
+    }
+  }
+  unlink("inlinedir");
+  unlink("inlinefile");
+
+  printf(1, "inline ok\n");
+}
+
+// A hashed directory must take entries past several buckets,
+// whichever bucket fills first.
+void
+hashdirtest(void)
+{
+  int i, fd, n;
+  char name[8];
+
+  printf(1, "hashdir test\n");
+
+  n = 6 * DPB;  // entries for at least six buckets
+  if(mkdir("hd") != 0){
+    printf(1, "hashdir: mkdir failed\n");
+    exit();
+  }
+  fd = open("hd/f", O_CREATE);
+  if(fd < 0){
+    printf(1, "hashdir: create failed\n");
+    exit();
+  }
+  close(fd);
+
+  name[0] = 'h';
+  name[1] = 'd';
+  name[2] = '/';
+  name[3] = 'x';
+  name[6] = '\0';
+  for(i = 0; i < n; i++){
+    name[4] = '0' + i / 64;
+    name[5] = '0' + i % 64;
+    if(link("hd/f", name) != 0){
+      printf(1, "hashdir: link %s failed\n", name);
+      exit();
+    }
+  }
+  for(i = 0; i < n; i++){
+    name[4] = '0' + i / 64;
+    name[5] = '0' + i % 64;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf(1, "hashdir: open %s failed\n", name);
+      exit();
+    }
+    close(fd);
+    if(unlink(name) != 0){
+      printf(1, "hashdir: unlink %s failed\n", name);
+      exit();
+    }
+  }
+  if(unlink("hd/f") != 0 || unlink("hd") != 0){
+    printf(1, "hashdir: cleanup failed\n");
+    exit();
+  }
+
+  printf(1, "hashdir ok\n");
+}
+
+// mmap maps the page cache's pages of a file read-only;
+// they must follow later writes, and survive fork.
+void
+mmaptest(void)
+{
+  int fd, i, pid;
+  char *p, *oldbrk;
+
+  printf(1, "mmap test\n");
+
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "mmap: create failed\n");
+    exit();
+  }
+  for(i = 0; i < 10; i++){
+    memset(buf, 'a'+i, 1000);
+    write(fd, buf, 1000);
+  }
+
+  oldbrk = sbrk(0);
+  if(mmap(fd, 100, 4096) != (void*)-1){
+    printf(1, "mmap: unaligned offset mapped\n");
+    exit();
+  }
+  p = mmap(fd, 4096, 8192);
+  if(p == (void*)-1 || (uint)p % 4096 || sbrk(0) != p + 8192){
+    printf(1, "mmap failed\n");
+    exit();
+  }
+  for(i = 4096; i < 10000; i++){
+    if(p[i-4096] != 'a' + i/1000){
+      printf(1, "mmap: wrong data at %d\n", i);
+      exit();
+    }
+  }
+  if(p[10000-4096] != 0){
+    printf(1, "mmap: past end not zero\n");
+    exit();
+  }
+
+  // A write shows through the mapping.
+  close(fd);
+  fd = open("mmapfile", O_RDWR);
+  read(fd, buf, 5000);
+  write(fd, "xyz", 3);
+  if(p[5000-4096] != 'x' || p[5002-4096] != 'z'){
+    printf(1, "mmap: write not seen\n");
+    exit();
+  }
+
+  // The kernel must not write into it either.
+  if(read(fd, p, 10) != -1){
+    printf(1, "mmap: read into mapping\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(1, "mmap: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[5001-4096] != 'y'){
+      printf(1, "mmap: child sees wrong data\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+
+  close(fd);
+  sbrk(oldbrk - (char*)sbrk(0));
+  unlink("mmapfile");
+
+  printf(1, "mmap ok\n");
+}
+
+// Readers of one file hold its lock shared.  Those with their
+// own descriptor each read all of it; those sharing one read
+// each part of it once between them.
+void
+sharedread(void)
+{
+  int fd, sfd, i, j, n, pid, total, sum, fds[2];
+  char b[512];
+
+  printf(1, "shared read test\n");
+
+  fd = open("sharedread", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "shared read: create failed\n");
+    exit();
+  }
+  for(i = 0; i < 40; i++){
+    memset(b, 'a' + i%26, sizeof(b));
+    write(fd, b, sizeof(b));
+  }
+  close(fd);
+
+  sfd = open("sharedread", O_RDONLY);
+  if(pipe(fds) != 0){
+    printf(1, "shared read: pipe failed\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "shared read: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      fd = i%2 ? open("sharedread", O_RDONLY) : sfd;
+      total = 0;
+      while((n = read(fd, b, sizeof(b))) > 0){
+        for(j = 0; j < n; j++){
+          if(b[j] != b[0]){
+            printf(1, "shared read: torn read\n");
+            exit();
+          }
+        }
+        total += n;
+      }
+      if(fd != sfd && total != 40*sizeof(b)){
+        printf(1, "shared read: read %d bytes\n", total);
+        exit();
+      }
+      if(fd == sfd)
+        write(fds[1], &total, sizeof(total));
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  close(fds[1]);
+  sum = 0;
+  while(read(fds[0], &total, sizeof(total)) == sizeof(total))
+    sum += total;
+  close(fds[0]);
+  if(sum != 40*sizeof(b)){
+    printf(1, "shared read: shared descriptor read %d bytes\n", sum);
+    exit();
+  }
+  close(sfd);
+  unlink("sharedread");
+
+  printf(1, "shared read ok\n");
+}
+
+// lseek moves the offset that read and write use; pread and
+// pwrite take their own and leave it alone.
+void
+seektest(void)
+{
+  int fd, i, j, pid, fds[2];
+  char b[16];
+
+  printf(1, "seek test\n");
+
+  fd = open("seekfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "seek: create failed\n");
+    exit();
+  }
+  for(i = 0; i < 100; i++){
+    memset(b, 'a' + i%26, sizeof(b));
+    write(fd, b, sizeof(b));
+  }
+  if(lseek(fd, 0, SEEK_CUR) != 1600 || lseek(fd, -16, SEEK_END) != 1584 ||
+     read(fd, b, sizeof(b)) != sizeof(b) || b[0] != 'a' + 99%26 ||
+     lseek(fd, 32, SEEK_SET) != 32 || read(fd, b, 1) != 1 || b[0] != 'c' ||
+     lseek(fd, -100, SEEK_CUR) != -1 || lseek(fd, 0, 7) != -1){
+    printf(1, "seek: lseek failed\n");
+    exit();
+  }
+
+  // Past the end: reads return nothing; a write leaves a hole.
+  if(lseek(fd, 2000, SEEK_SET) != 2000 || read(fd, b, sizeof(b)) != 0 ||
+     write(fd, "end", 3) != 3 || lseek(fd, 1700, SEEK_SET) != 1700 ||
+     read(fd, b, 4) != 4 || b[0] != 0 || b[3] != 0){
+    printf(1, "seek: past end failed\n");
+    exit();
+  }
+
+  if(pread(fd, b, 3, 2000) != 3 || b[0] != 'e' ||
+     pwrite(fd, "X", 1, 16) != 1 || pread(fd, b, 2, 16) != 2 ||
+     b[0] != 'X' || b[1] != 'b' || pread(fd, b, 4, 5000) != 0 ||
+     pread(fd, b, 1, -1) != -1 || lseek(fd, 0, SEEK_CUR) != 1704){
+    printf(1, "seek: pread or pwrite failed\n");
+    exit();
+  }
+
+  // Children sharing fd each read their own records.
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "seek: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      for(j = i+2; j < 100; j += 4){
+        if(pread(fd, b, sizeof(b), j*sizeof(b)) != sizeof(b) ||
+           b[0] != 'a' + j%26 || b[15] != 'a' + j%26){
+          printf(1, "seek: child read record %d wrong\n", j);
+          exit();
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  if(lseek(fd, 0, SEEK_CUR) != 1704){
+    printf(1, "seek: children moved the offset\n");
+    exit();
+  }
+  close(fd);
+
+  if(pipe(fds) != 0 || lseek(fds[0], 0, SEEK_SET) != -1 ||
+     pread(fds[0], b, 1, 0) != -1){
+    printf(1, "seek: pipe seeked\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("seekfile");
+
+  printf(1, "seek ok\n");
+}
+
+// Processes changing the file system at once share commits of
+// the log; once they are done, everything they used is free.
+void
+logtest(void)
+{
+  struct statfs st0, st1;
+  char name[4], buf[512];
+  int i, j, pid, fd;
+
+  printf(1, "log test\n");
+
+  sync();
+  statfs(&st0);
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      name[0] = 'l';
+      name[1] = '0' + i;
+      name[3] = '\0';
+      memset(buf, '0' + i, sizeof(buf));
+      for(j = 0; j < 20; j++){
+        name[2] = '0' + j%10;
+        fd = open(name, O_CREATE|O_RDWR);
+        if(fd < 0){
+          printf(1, "log: create %s failed\n", name);
+          exit();
+        }
+        write(fd, buf, sizeof(buf));
+        write(fd, buf, sizeof(buf));
+        close(fd);
+        if(j % 5 == 0)
+          sync();
+        if(unlink(name) != 0){
+          printf(1, "log: unlink %s failed\n", name);
+          exit();
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+
+  sync();
+  statfs(&st1);
+  if(st1.bfree != st0.bfree || st1.ffree != st0.ffree){
+    printf(1, "log: lost %d blocks, %d inodes\n",
+           st0.bfree - st1.bfree, st0.ffree - st1.ffree);
+    exit();
+  }
+  printf(1, "log ok\n");
+}
+
 void
 rmdot(void)
 {
@@ -1525,6 +2195,17 @@ main(int argc, char *argv[])
   rmdot();
   fourteen();
   bigfile();
+  synctest();
+  statfstest();
+  sparsetest();
+  dalloctest();
+  logtest();
+  overwritetest();
+  inlinetest();
+  hashdirtest();
+  mmaptest();
+  sharedread();
+  seektest();
   subdir();
   concreate();
   linktest();